@@ -0,0 +1,139 @@
+/*
+ * DjMM
+ * v0.1
+ *
+ * Copyright (c) 2011, David J. Rager
+ * djrager@fourthwoods.com
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * djmm_handle.c
+ *
+ *  Created on: Oct 16, 2026
+ *      Author: David J. Rager
+ *       Email: djrager@fourthwoods.com
+ */
+#include <windows.h>
+
+#include "djmm_handle.h"
+
+// A handle is (generation << HANDLE_SLOT_BITS) | slot. The generation is kept
+// small enough that the value is always positive and never zero.
+#define HANDLE_SLOT_BITS	10
+#define HANDLE_SLOTS		(1 << HANDLE_SLOT_BITS)
+#define HANDLE_SLOT_MASK	(HANDLE_SLOTS - 1)
+#define HANDLE_GEN_MASK		(0x7fffffff >> HANDLE_SLOT_BITS)
+
+struct dj_handle_entry {
+  volatile LONG id;      // handle currently issued for this slot, 0 when free
+  volatile LONG claimed; // slot is in use, from alloc until free returns
+  volatile LONG refs;    // outstanding dj_handle_acquire() calls
+  unsigned int generation;
+  unsigned int type;
+  void* object;
+};
+
+static struct dj_handle_entry handles[HANDLE_SLOTS];
+static volatile LONG next_slot = 0;
+
+static struct dj_handle_entry* _dj_handle_entry(DJ_HANDLE h) {
+  ULONG_PTR id = (ULONG_PTR)h;
+
+  if (id == 0 || id > 0x7fffffff)
+    return NULL;
+
+  return &handles[id & HANDLE_SLOT_MASK];
+}
+
+DJ_HANDLE dj_handle_alloc(unsigned int type, void* object) {
+  struct dj_handle_entry* e;
+  unsigned int i, slot;
+  LONG id;
+
+  // Start after the last slot handed out so a closed handle's slot is not
+  // reused straight away.
+  slot = (unsigned int)InterlockedIncrement(&next_slot);
+  for (i = 0; i < HANDLE_SLOTS; i++, slot++) {
+    e = &handles[slot & HANDLE_SLOT_MASK];
+    if (InterlockedCompareExchange(&e->claimed, 1, 0) != 0)
+      continue;
+
+    e->generation = (e->generation + 1) & HANDLE_GEN_MASK;
+    if (e->generation == 0)
+      e->generation = 1;
+
+    e->type = type;
+    e->object = object;
+
+    id = (LONG)((e->generation << HANDLE_SLOT_BITS) | (slot & HANDLE_SLOT_MASK));
+    InterlockedExchange(&e->id, id);
+
+    return (DJ_HANDLE)(ULONG_PTR)id;
+  }
+
+  return NULL;
+}
+
+void* dj_handle_free(DJ_HANDLE h, unsigned int type) {
+  struct dj_handle_entry* e = _dj_handle_entry(h);
+  LONG id = (LONG)(ULONG_PTR)h;
+  void* object;
+
+  if (e == NULL || e->id != id || e->type != type)
+    return NULL;
+
+  // Only one caller can win this, everyone else sees a stale handle.
+  if (InterlockedCompareExchange(&e->id, 0, id) != id)
+    return NULL;
+
+  while (e->refs != 0)
+    Sleep(0);
+
+  object = e->object;
+  e->object = NULL;
+  InterlockedExchange(&e->claimed, 0);
+
+  return object;
+}
+
+void* dj_handle_acquire(DJ_HANDLE h, unsigned int type) {
+  struct dj_handle_entry* e = _dj_handle_entry(h);
+  LONG id = (LONG)(ULONG_PTR)h;
+
+  if (e == NULL || e->id != id)
+    return NULL;
+
+  // Take the reference before checking again. Once dj_handle_free() has
+  // cleared the id it waits for us to drop it.
+  InterlockedIncrement(&e->refs);
+  if (e->id != id || e->type != type) {
+    InterlockedDecrement(&e->refs);
+    return NULL;
+  }
+
+  return e->object;
+}
+
+void dj_handle_release(DJ_HANDLE h) {
+  struct dj_handle_entry* e = _dj_handle_entry(h);
+
+  if (e != NULL)
+    InterlockedDecrement(&e->refs);
+}
@@ -0,0 +1,84 @@
+/*
+ * DjMM
+ * v0.1
+ *
+ * Copyright (c) 2011, David J. Rager
+ * djrager@fourthwoods.com
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * djmm_handle.h
+ *
+ *  Created on: Oct 16, 2026
+ *      Author: David J. Rager
+ *       Email: djrager@fourthwoods.com
+ */
+
+#ifndef DJMM_HANDLE_H_
+#define DJMM_HANDLE_H_
+
+#include "dj_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DJ_HANDLE_PCM	1
+#define DJ_HANDLE_MUS	2
+#define DJ_HANDLE_MID	3
+
+/*
+ * Handles returned by the players are not pointers. They encode a slot in a
+ * shared table plus the generation of that slot, so looking one up is a
+ * bounds check and a compare, and a handle that has been closed stays
+ * invalid even after its slot is reused.
+ *
+ * None of these functions take a global lock.
+ */
+
+/*
+ * Registers object under a new handle. Returns NULL if the table is full.
+ */
+DJ_HANDLE dj_handle_alloc(unsigned int type, void* object);
+
+/*
+ * Invalidates h and returns its object, or NULL if h is not a live handle of
+ * the given type. Waits for every dj_handle_acquire() on h to be released
+ * before returning, so the caller may free the object afterwards. Must not
+ * be called while holding a reference to h.
+ */
+void* dj_handle_free(DJ_HANDLE h, unsigned int type);
+
+/*
+ * Returns the object for h, or NULL if h is not a live handle of the given
+ * type. The object stays valid until the matching dj_handle_release().
+ */
+void* dj_handle_acquire(DJ_HANDLE h, unsigned int type);
+
+/*
+ * Drops a reference taken by a successful dj_handle_acquire().
+ */
+void dj_handle_release(DJ_HANDLE h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DJMM_HANDLE_H_ */
@@ -41,6 +41,7 @@
 
 #include "dj_debug.h"
 #include "djmm_utils.h"
+#include "djmm_handle.h"
 
 #else
 
@@ -155,6 +156,7 @@ struct mid_player
 	HANDLE thread;
 	HANDLE ready;
 	HANDLE mutex;
+	DJ_HANDLE handle; // registry handle given to the user
 
 	HMIDISTRM stream;
 	MIDIHDR header[2]; // double buffer
@@ -220,8 +222,8 @@ static void mid_player_shutdown(struct mid_player* p);
 static void mid_close_stream(struct mid_player* p);
 static void mid_rewind(struct mid_score* m);
 
-static DJ_RESULT mid_lock_score(DJ_HANDLE h);
-static DJ_RESULT mid_unlock_score(DJ_HANDLE h);
+static DJ_RESULT mid_lock_score(DJ_HANDLE h, struct mid_player** out);
+static DJ_RESULT mid_unlock_score(DJ_HANDLE h, struct mid_player* p);
 
 static void CALLBACK mid_callback_proc(HMIDIOUT hmo, UINT wMsg, DWORD_PTR dwInstance, DWORD_PTR dwParam1, DWORD_PTR dwParam2)
 {
@@ -491,7 +493,7 @@ void mid_shutdown()
 
 		// This function acquires players_mutex and tmp->mutex so make sure
 		// they are not held here.
-		mid_score_close(tmp);
+		mid_score_close(tmp->handle);
 
 		err = WaitForSingleObject(players_mutex, INFINITE);
 		if(err == WAIT_FAILED)
@@ -799,6 +801,13 @@ DJ_HANDLE mid_score_open(unsigned char* buf, unsigned int len)
 
 	p->score = s;
 
+	p->handle = dj_handle_alloc(DJ_HANDLE_MID, p);
+	if(p->handle == NULL)
+	{
+		DJ_TRACE("mid_score_open(): dj_handle_alloc failed\n");
+		goto error5;
+	}
+
 	// Score is loaded and ready. Add the player to our global list
 	// and return the "HANDLE" to the user.
 
@@ -815,10 +824,9 @@ DJ_HANDLE mid_score_open(unsigned char* buf, unsigned int len)
 	if(err == 0)
 	{
 		DJ_TRACE("mid_score_open(): ReleaseMutex failed: %lu, %s\n", GetLastError(), DJ_FORMAT_MESSAGE(GetLastError()));
-		goto error5;
 	}
 
-	return p;
+	return p->handle;
 
 error5:
 	free(s->tracks);
@@ -837,33 +845,6 @@ error1:
 	return NULL;
 }
 
-/**
- * @brief This function determines if a HANDLE is was opened with mid_score_open().
- *
- * This function determines if a HANDLE is was opened with mid_score_open() and
- * is in the global list. This helper function should be called while holding
- * the players_mutex.
- *
- * @param h	The handle to test
- * @return	TRUE if the handle is valid, FALSE otherwise.
- */
-static boolean mid_is_handle_valid(DJ_HANDLE h)
-{
-	struct mid_player* p = players;
-	if(h == NULL)
-		return false;
-
-	while(p != NULL)
-	{
-		if(p == h)
-			return true;
-		else
-			p = p->next;
-	}
-
-	return false;
-}
-
 /**
  * @brief This function stops any buffers that are currently playing and closes the
  * stream.
@@ -908,43 +889,37 @@ void mid_score_close(DJ_HANDLE h)
 {
 	unsigned int err;
 	struct mid_player* p = NULL;
+	struct mid_player* tmp = NULL;
 
-	err = WaitForSingleObject(players_mutex, INFINITE);
-	if(err == WAIT_FAILED)
+	// Freeing the handle waits for any call still using it to finish. Any
+	// further calls using this handle will return MMSYSERR_INVALPARAM.
+	p = (struct mid_player*)dj_handle_free(h, DJ_HANDLE_MID);
+	if(p == NULL)
 	{
-		DJ_TRACE("mid_score_close(): WaitForSingleObject failed: %lu, %s\n", GetLastError(), DJ_FORMAT_MESSAGE(GetLastError()));
+		DJ_TRACE("mid_score_close(): invalid handle\n");
+		return;
 	}
 
-	if(mid_is_handle_valid(h) == false)
+	err = WaitForSingleObject(players_mutex, INFINITE);
+	if(err == WAIT_FAILED)
 	{
-		err = ReleaseMutex(players_mutex);
-		if(err == 0)
-		{
-			DJ_TRACE("mid_score_close(): ReleaseMutex failed: %lu, %s\n", GetLastError(), DJ_FORMAT_MESSAGE(GetLastError()));
-		}
+		DJ_TRACE("mid_score_close(): WaitForSingleObject failed: %lu, %s\n", GetLastError(), DJ_FORMAT_MESSAGE(GetLastError()));
 	}
 
-	p = players;
-	if(p == h) // if h is the first in the list
+	if(players == p) // if p is the first in the list
 	{
 		players = p->next;
-		p->next = NULL;
 	}
 	else
 	{
-		while(p != NULL)
-		{
-			if(p->next == h)
-			{
-				p->next = p->next->next;
-				p = h;
-				p->next = NULL;
-				break;
-			}
-			else
-				p = p->next;
-		}
+		tmp = players;
+		while(tmp != NULL && tmp->next != p)
+			tmp = tmp->next;
+
+		if(tmp != NULL)
+			tmp->next = p->next;
 	}
+	p->next = NULL;
 
 	err = ReleaseMutex(players_mutex);
 	if(err == 0)
@@ -952,9 +927,6 @@ void mid_score_close(DJ_HANDLE h)
 		DJ_TRACE("mid_score_close(): ReleaseMutex failed: %lu, %s\n", GetLastError(), DJ_FORMAT_MESSAGE(GetLastError()));
 	}
 
-	// The player has been removed from the global list. Any further calls
-	// using this handle will return MMSYSERR_INVALPARAM.
-
 	// Start shutting down the thread. If it's still playing, stop it.
 	err = WaitForSingleObject(p->mutex, INFINITE);
 	if(err == WAIT_FAILED)
@@ -1014,10 +986,10 @@ void mid_score_close(DJ_HANDLE h)
 
 DJ_RESULT mid_register_callback(DJ_HANDLE h, mid_notify_cb cb)
 {
-	struct mid_player* p = (struct mid_player*)h;
+	struct mid_player* p = NULL;
 	unsigned int err = MMSYSERR_NOERROR;
 
-	err = mid_lock_score(h);
+	err = mid_lock_score(h, &p);
 	if(err != MMSYSERR_NOERROR)
 	{
 		DJ_TRACE("mid_pause(): mid_lock_score failed: %d, %s\n", err, mid_format_error(err));
@@ -1026,7 +998,7 @@ DJ_RESULT mid_register_callback(DJ_HANDLE h, mid_notify_cb cb)
 
 	p->cb = cb;
 
-	err = mid_unlock_score(h);
+	err = mid_unlock_score(h, p);
 	if(err != MMSYSERR_NOERROR)
 	{
 		DJ_TRACE("mid_play(): mid_unlock_score failed: %d, %s\n", err, mid_format_error(err));
@@ -1038,11 +1010,11 @@ DJ_RESULT mid_register_callback(DJ_HANDLE h, mid_notify_cb cb)
 
 DJ_RESULT mid_play(DJ_HANDLE h)
 {
-	struct mid_player* p = (struct mid_player*)h;
+	struct mid_player* p = NULL;
 	unsigned int err = MMSYSERR_NOERROR;
 	MIDIPROPTIMEDIV prop;
 
-	err = mid_lock_score(h);
+	err = mid_lock_score(h, &p);
 	if(err != MMSYSERR_NOERROR)
 	{
 		DJ_TRACE("mid_play(): mid_lock_score failed: %d, %s\n", err, mid_format_error(err));
@@ -1131,7 +1103,7 @@ DJ_RESULT mid_play(DJ_HANDLE h)
 	}
 
 error:
-	err = mid_unlock_score(h);
+	err = mid_unlock_score(h, p);
 	if(err != MMSYSERR_NOERROR)
 	{
 		DJ_TRACE("mid_play(): mid_unlock_score failed: %d, %s\n", err, mid_format_error(err));
@@ -1143,10 +1115,10 @@ error:
 
 DJ_RESULT mid_stop(DJ_HANDLE h)
 {
-	struct mid_player* p = (struct mid_player*)h;
+	struct mid_player* p = NULL;
 	unsigned int err = MMSYSERR_NOERROR;
 
-	err = mid_lock_score(h);
+	err = mid_lock_score(h, &p);
 	if(err != MMSYSERR_NOERROR)
 	{
 		DJ_TRACE("mid_stop(): mid_lock_score failed: %lu, %s\n", err, mid_format_error(err));
@@ -1159,10 +1131,10 @@ DJ_RESULT mid_stop(DJ_HANDLE h)
 		if(err == 0)
 		{
 			DJ_TRACE("mid_stop(): ResetEvent failed: %lu, %s\n", GetLastError(), DJ_FORMAT_MESSAGE(GetLastError()));
-			err = ReleaseMutex(p->mutex);
-			if(err == 0)
+			err = mid_unlock_score(h, p);
+			if(err != MMSYSERR_NOERROR)
 			{
-				DJ_TRACE("mid_stop(): ReleaseMutex failed: %lu, %s\n", GetLastError(), DJ_FORMAT_MESSAGE(GetLastError()));
+				DJ_TRACE("mid_stop(): mid_unlock_score failed: %lu, %s\n", err, mid_format_error(err));
 			}
 
 			return MMSYSERR_ERROR;
@@ -1174,7 +1146,7 @@ DJ_RESULT mid_stop(DJ_HANDLE h)
 		if(err == 0)
 		{
 			DJ_TRACE("mid_stop(): SetEvent failed: %lu, %s\n", GetLastError(), DJ_FORMAT_MESSAGE(GetLastError()));
-			err = mid_unlock_score(h);
+			err = mid_unlock_score(h, p);
 			if(err != MMSYSERR_NOERROR)
 			{
 				DJ_TRACE("mid_stop(): mid_unlock_score failed: %lu, %s\n", err, mid_format_error(err));
@@ -1184,7 +1156,7 @@ DJ_RESULT mid_stop(DJ_HANDLE h)
 			return MMSYSERR_ERROR;
 		}
 
-		err = mid_unlock_score(h);
+		err = mid_unlock_score(h, p);
 		if(err != MMSYSERR_NOERROR)
 		{
 			DJ_TRACE("mid_stop(): mid_unlock_score failed: %lu, %s\n", err, mid_format_error(err));
@@ -1200,7 +1172,7 @@ DJ_RESULT mid_stop(DJ_HANDLE h)
 	}
 	else
 	{
-		err = mid_unlock_score(h);
+		err = mid_unlock_score(h, p);
 		if(err != MMSYSERR_NOERROR)
 		{
 			DJ_TRACE("mid_stop(): mid_unlock_score failed: %lu, %s\n", err, mid_format_error(err));
@@ -1213,10 +1185,10 @@ DJ_RESULT mid_stop(DJ_HANDLE h)
 
 DJ_RESULT mid_pause(DJ_HANDLE h)
 {
-	struct mid_player* p = (struct mid_player*)h;
+	struct mid_player* p = NULL;
 	unsigned int err = MMSYSERR_NOERROR;
 
-	err = mid_lock_score(h);
+	err = mid_lock_score(h, &p);
 	if(err != MMSYSERR_NOERROR)
 	{
 		DJ_TRACE("mid_pause(): mid_lock_score failed: %d, %s\n", err, mid_format_error(err));
@@ -1242,7 +1214,7 @@ DJ_RESULT mid_pause(DJ_HANDLE h)
 			p->state = STATE_PAUSED;
 	}
 
-	err = mid_unlock_score(h);
+	err = mid_unlock_score(h, p);
 	if(err != MMSYSERR_NOERROR)
 	{
 		DJ_TRACE("mid_pause(): mid_unlock_score failed: %d, %s\n", err, mid_format_error(err));
@@ -1254,10 +1226,10 @@ DJ_RESULT mid_pause(DJ_HANDLE h)
 
 DJ_RESULT mid_resume(DJ_HANDLE h)
 {
-	struct mid_player* p = (struct mid_player*)h;
+	struct mid_player* p = NULL;
 	unsigned int err = MMSYSERR_NOERROR;
 
-	err = mid_lock_score(h);
+	err = mid_lock_score(h, &p);
 	if(err != MMSYSERR_NOERROR)
 	{
 		DJ_TRACE("mid_resume(): mid_lock_score failed: %d, %s\n", err, mid_format_error(err));
@@ -1283,7 +1255,7 @@ DJ_RESULT mid_resume(DJ_HANDLE h)
 			p->state = STATE_PLAYING;
 	}
 
-	err = mid_unlock_score(h);
+	err = mid_unlock_score(h, p);
 	if(err != MMSYSERR_NOERROR)
 	{
 		DJ_TRACE("mid_resume(): mid_unlock_score failed: %d, %s\n", err, mid_format_error(err));
@@ -1296,11 +1268,11 @@ DJ_RESULT mid_resume(DJ_HANDLE h)
 DJ_RESULT mid_set_volume_left(DJ_HANDLE h, unsigned int level)
 {
 	unsigned int old = 0, vol = 0;
-	struct mid_player* p = (struct mid_player*)h;
+	struct mid_player* p = NULL;
 	unsigned int err = MMSYSERR_NOERROR;
 	HMIDISTRM stream = (HMIDISTRM)MIDI_MAPPER;
 
-	err = mid_lock_score(h);
+	err = mid_lock_score(h, &p);
 	if(err == MMSYSERR_NOERROR)
 	{
 		stream = p->stream;
@@ -1322,7 +1294,7 @@ DJ_RESULT mid_set_volume_left(DJ_HANDLE h, unsigned int level)
 		DJ_TRACE("mid_set_volume_left(): err setting left volume: %d, %s\n", err, mid_format_error(err));
 	}
 
-	err = mid_unlock_score(h);
+	err = mid_unlock_score(h, p);
 	if(err == MMSYSERR_INVALPARAM)
 	{
 		DJ_TRACE("mid_set_volume_left(): mid_unlock_score failed: %d, %s\n", err, mid_format_error(err));
@@ -1335,11 +1307,11 @@ DJ_RESULT mid_set_volume_left(DJ_HANDLE h, unsigned int level)
 DJ_RESULT mid_set_volume_right(DJ_HANDLE h, unsigned int level)
 {
 	unsigned int old = 0, vol = 0;
-	struct mid_player* p = (struct mid_player*)h;
+	struct mid_player* p = NULL;
 	unsigned int err = MMSYSERR_NOERROR;
 	HMIDISTRM stream = (HMIDISTRM)MIDI_MAPPER;
 
-	err = mid_lock_score(h);
+	err = mid_lock_score(h, &p);
 	if(err == MMSYSERR_NOERROR)
 	{
 		stream = p->stream;
@@ -1361,7 +1333,7 @@ DJ_RESULT mid_set_volume_right(DJ_HANDLE h, unsigned int level)
 		DJ_TRACE("mid_set_volume_right(): err setting right volume: %d, %s\n", err, mid_format_error(err));
 	}
 
-	err = mid_unlock_score(h);
+	err = mid_unlock_score(h, p);
 	if(err == MMSYSERR_INVALPARAM)
 	{
 		DJ_TRACE("mid_set_volume_right(): mid_unlock_score failed: %d, %s\n", err, mid_format_error(err));
@@ -1384,11 +1356,11 @@ DJ_RESULT mid_set_volume(DJ_HANDLE h, unsigned int level)
 
 DJ_RESULT mid_get_volume_left(DJ_HANDLE h, unsigned int* level)
 {
-	struct mid_player* p = (struct mid_player*)h;
+	struct mid_player* p = NULL;
 	unsigned int err = MMSYSERR_NOERROR;
 	HMIDISTRM stream = (HMIDISTRM)MIDI_MAPPER;
 
-	err = mid_lock_score(h);
+	err = mid_lock_score(h, &p);
 	if(err == MMSYSERR_NOERROR)
 	{
 		stream = p->stream;
@@ -1409,7 +1381,7 @@ DJ_RESULT mid_get_volume_left(DJ_HANDLE h, unsigned int* level)
 		DJ_TRACE("mid_get_volume_left(): err getting right volume: %d, %s\n", err, mid_format_error(err));
 	}
 
-	err = mid_unlock_score(h);
+	err = mid_unlock_score(h, p);
 	if(err == MMSYSERR_INVALPARAM)
 	{
 		DJ_TRACE("mid_get_volume_left(): mid_unlock_score failed: %d, %s\n", err, mid_format_error(err));
@@ -1421,11 +1393,11 @@ DJ_RESULT mid_get_volume_left(DJ_HANDLE h, unsigned int* level)
 
 DJ_RESULT mid_get_volume_right(DJ_HANDLE h, unsigned int* level)
 {
-	struct mid_player* p = (struct mid_player*)h;
+	struct mid_player* p = NULL;
 	unsigned int err = MMSYSERR_NOERROR;
 	HMIDISTRM stream = (HMIDISTRM)MIDI_MAPPER;
 
-	err = mid_lock_score(h);
+	err = mid_lock_score(h, &p);
 	if(err == MMSYSERR_NOERROR)
 	{
 		stream = p->stream;
@@ -1446,7 +1418,7 @@ DJ_RESULT mid_get_volume_right(DJ_HANDLE h, unsigned int* level)
 		DJ_TRACE("mid_get_volume_right(): err getting right volume: %d, %s\n", err, mid_format_error(err));
 	}
 
-	err = mid_unlock_score(h);
+	err = mid_unlock_score(h, p);
 	if(err == MMSYSERR_INVALPARAM)
 	{
 		DJ_TRACE("mid_get_volume_right(): mid_unlock_score failed: %d, %s\n", err, mid_format_error(err));
@@ -1463,10 +1435,10 @@ DJ_RESULT mid_get_volume(DJ_HANDLE h, unsigned int* level)
 
 DJ_RESULT mid_set_looping(DJ_HANDLE h, boolean looping)
 {
-	struct mid_player* p = (struct mid_player*)h;
+	struct mid_player* p = NULL;
 	unsigned int err = MMSYSERR_NOERROR;
 
-	err = mid_lock_score(h);
+	err = mid_lock_score(h, &p);
 	if(err != MMSYSERR_NOERROR)
 	{
 		DJ_TRACE("mid_set_looping(): mid_lock_score failed: %d, %s\n", err, mid_format_error(err));
@@ -1475,7 +1447,7 @@ DJ_RESULT mid_set_looping(DJ_HANDLE h, boolean looping)
 
 	p->looping = looping;
 
-	err = mid_unlock_score(h);
+	err = mid_unlock_score(h, p);
 	if(err != MMSYSERR_NOERROR)
 	{
 		DJ_TRACE("mid_set_looping(): mid_unlock_score failed: %d, %s\n", err, mid_format_error(err));
@@ -1487,11 +1459,11 @@ DJ_RESULT mid_set_looping(DJ_HANDLE h, boolean looping)
 
 boolean mid_is_looping(DJ_HANDLE h)
 {
-	struct mid_player* p = (struct mid_player*)h;
+	struct mid_player* p = NULL;
 	unsigned int err = MMSYSERR_NOERROR;
 	boolean looping;
 
-	err = mid_lock_score(h);
+	err = mid_lock_score(h, &p);
 	if(err != MMSYSERR_NOERROR)
 	{
 		DJ_TRACE("mid_get_looping(): mid_lock_score failed: %d, %s\n", err, mid_format_error(err));
@@ -1500,7 +1472,7 @@ boolean mid_is_looping(DJ_HANDLE h)
 
 	looping = p->looping;
 
-	err = mid_unlock_score(h);
+	err = mid_unlock_score(h, p);
 	if(err != MMSYSERR_NOERROR)
 	{
 		DJ_TRACE("mid_get_looping(): mid_unlock_score failed: %d, %s\n", err, mid_format_error(err));
@@ -1512,75 +1484,65 @@ boolean mid_is_looping(DJ_HANDLE h)
 
 boolean mid_is_playing(DJ_HANDLE h)
 {
-	struct mid_player* p = (struct mid_player*)h;
+	struct mid_player* p = NULL;
 	unsigned int err = MMSYSERR_NOERROR;
 	boolean ret = false;
 
-	err = mid_lock_score(h);
+	err = mid_lock_score(h, &p);
 	if(err != MMSYSERR_NOERROR)
 		return false;
 
 	ret = (p->state == STATE_PLAYING);
 
-	mid_unlock_score(h);
+	mid_unlock_score(h, p);
 
 	return ret;
 }
 
 boolean mid_is_paused(DJ_HANDLE h)
 {
-	struct mid_player* p = (struct mid_player*)h;
+	struct mid_player* p = NULL;
 	unsigned int err = MMSYSERR_NOERROR;
 	boolean ret = false;
 
-	err = mid_lock_score(h);
+	err = mid_lock_score(h, &p);
 	if(err != MMSYSERR_NOERROR)
 		return false;
 
 	ret = (p->state == STATE_PAUSED);
 
-	mid_unlock_score(h);
+	mid_unlock_score(h, p);
 	
 	return ret;
 }
 
 boolean mid_is_stopped(DJ_HANDLE h)
 {
-	struct mid_player* p = (struct mid_player*)h;
+	struct mid_player* p = NULL;
 	unsigned int err = MMSYSERR_NOERROR;
 	boolean ret = false;
 
-	err = mid_lock_score(h);
+	err = mid_lock_score(h, &p);
 	if(err != MMSYSERR_NOERROR)
 		return false;
 
 	ret = (p->state == STATE_STOPPED);
 
-	mid_unlock_score(h);
+	mid_unlock_score(h, p);
 
 	return ret;
 }
 
-static DJ_RESULT mid_lock_score(DJ_HANDLE h)
+static DJ_RESULT mid_lock_score(DJ_HANDLE h, struct mid_player** out)
 {
-	struct mid_player* p = (struct mid_player*)h;
+	struct mid_player* p = NULL;
 	unsigned int err = MMSYSERR_NOERROR;
 
-	err = WaitForSingleObject(players_mutex, INFINITE);
-	if(err == WAIT_FAILED)
-	{
-		DJ_TRACE("mid_lock_score(): WaitForSingleObject failed: %lu, %s\n", GetLastError(), DJ_FORMAT_MESSAGE(GetLastError()));
-		return MMSYSERR_ERROR;
-	}
-
-	if(mid_is_handle_valid(h) == false)
+	// The reference keeps mid_score_close() from freeing the player until
+	// mid_unlock_score() is called.
+	p = (struct mid_player*)dj_handle_acquire(h, DJ_HANDLE_MID);
+	if(p == NULL)
 	{
-		err = ReleaseMutex(players_mutex);
-		if(err == 0)
-		{
-			DJ_TRACE("mid_lock_score(): ReleaseMutex failed: %lu, %s\n", GetLastError(), DJ_FORMAT_MESSAGE(GetLastError()));
-		}
-
 		return MMSYSERR_INVALPARAM;
 	}
 
@@ -1588,62 +1550,28 @@ static DJ_RESULT mid_lock_score(DJ_HANDLE h)
 	if(err == WAIT_FAILED)
 	{
 		DJ_TRACE("mid_lock_score(): WaitForSingleObject failed: %lu, %s\n", GetLastError(), DJ_FORMAT_MESSAGE(GetLastError()));
-		err = ReleaseMutex(players_mutex);
-		if(err == 0)
-		{
-			DJ_TRACE("mid_lock_score(): ReleaseMutex failed: %lu, %s\n", GetLastError(), DJ_FORMAT_MESSAGE(GetLastError()));
-		}
-
+		dj_handle_release(h);
 		return MMSYSERR_ERROR;
 	}
 
-	err = ReleaseMutex(players_mutex);
-	if(err == 0)
-	{
-		DJ_TRACE("mid_lock_score(): ReleaseMutex failed: %lu, %s\n", GetLastError(), DJ_FORMAT_MESSAGE(GetLastError()));
-		err = ReleaseMutex(p->mutex);
-		if(err == 0)
-		{
-			DJ_TRACE("mid_lock_score(): ReleaseMutex failed: %lu, %s\n", GetLastError(), DJ_FORMAT_MESSAGE(GetLastError()));
-		}
-
-		return MMSYSERR_ERROR;
-	}
+	*out = p;
 
 	return MMSYSERR_NOERROR;
 }
 
-static DJ_RESULT mid_unlock_score(DJ_HANDLE h)
+static DJ_RESULT mid_unlock_score(DJ_HANDLE h, struct mid_player* p)
 {
-	struct mid_player* p = (struct mid_player*)h;
 	unsigned int err = MMSYSERR_NOERROR;
 
-	err = WaitForSingleObject(players_mutex, INFINITE);
-	if(err == WAIT_FAILED)
-	{
-		DJ_TRACE("mid_unlock_score(): WaitForSingleObject failed: %lu, %s\n", GetLastError(), DJ_FORMAT_MESSAGE(GetLastError()));
-		return MMSYSERR_ERROR;
-	}
-
-	if(mid_is_handle_valid(h) == false)
+	// The volume calls fall back to the mapper when mid_lock_score()
+	// failed, so there is nothing to release.
+	if(p == NULL)
 	{
-		err = ReleaseMutex(players_mutex);
-		if(err == 0)
-		{
-			DJ_TRACE("mid_unlock_score(): ReleaseMutex failed: %lu, %s\n", GetLastError(), DJ_FORMAT_MESSAGE(GetLastError()));
-		}
-
 		return MMSYSERR_INVALPARAM;
 	}
 
-	err = ReleaseMutex(players_mutex);
-	if(err == 0)
-	{
-		DJ_TRACE("mid_unlock_score(): ReleaseMutex failed: %lu, %s\n", GetLastError(), DJ_FORMAT_MESSAGE(GetLastError()));
-		return MMSYSERR_ERROR;
-	}
-
 	err = ReleaseMutex(p->mutex);
+	dj_handle_release(h);
 	if(err == 0)
 	{
 		DJ_TRACE("mid_unlock_score(): ReleaseMutex failed: %lu, %s\n", GetLastError(), DJ_FORMAT_MESSAGE(GetLastError()));
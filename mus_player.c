@@ -35,6 +35,7 @@
 #include <mmsystem.h>
 
 #include "mus_player.h"
+#include "djmm_handle.h"
 
 #define STATE_ERROR		0
 #define STATE_STARTING	1
@@ -84,6 +85,7 @@ struct mus_player {
 	HANDLE thread;
 	HANDLE ready;
 	HANDLE mutex;
+	DJ_HANDLE handle; // registry handle given to the user
 
 	HMIDISTRM stream;
 	MIDIHDR header[2]; // double buffer
@@ -263,7 +265,7 @@ void mus_shutdown() {
 
 		// This function acquires players_mutex and tmp->mutex so make sure
 		// they are not held here.
-		mus_score_close(tmp);
+		mus_score_close(tmp->handle);
 
 		WaitForSingleObject(players_mutex, INFINITE);
 		tmp = players;
@@ -489,11 +491,18 @@ DJ_HANDLE mus_score_open(unsigned char* buf, unsigned int len, mus_notify_cb cal
 
 	p->score = s;
 
+	p->handle = dj_handle_alloc(DJ_HANDLE_MUS, p);
+	if (p->handle == NULL)
+		goto error4;
+
 	// Score is loaded and ready. Add the player to our global list
 	// and return the "HANDLE" to the user.
 	mus_add_player(p);
 
-	return p;
+	return p->handle;
+
+	error4:
+	free(s->raw_bytes);
 
 	error3:
 	free(s);
@@ -506,43 +515,6 @@ DJ_HANDLE mus_score_open(unsigned char* buf, unsigned int len, mus_notify_cb cal
 	return NULL;
 }
 
-/*!
- * This function determines if a HANDLE is was opened with mus_score_open().
- *
- * This function determines if a HANDLE is was opened with mus_score_open() and
- * is in the global list. This helper function should be called while holding
- * the players_mutex.
- *
- * This function is called by mus_score_close with players_mutex held.
- * This function is called by mus_play mus_stop with players_mutex held.
- * This function is called by mus_pause with players_mutex held.
- * This function is called by mus_resume with players_mutex held.
- * This function is called by mus_set_volume_left with players_mutex held.
- * This function is called by mus_set_volume_right with players_mutex held.
- * This function is called by mus_volume_left with players_mutex held.
- * This function is called by mus_volume_right with players_mutex held.
- * This function is called by mus_is_playing with players_mutex held.
- * This function is called by mus_is_paused with players_mutex held.
- * This function is called by mus_is_stopped with players_mutex held.
- *
- * @param h
- * @return
- */
-static boolean mus_is_handle_valid(DJ_HANDLE h) {
-	struct mus_player* p = players;
-	if (h == NULL)
-		return false;
-
-	while (p != NULL) {
-		if (p == h)
-			return true;
-		else
-			p = p->next;
-	}
-
-	return false;
-}
-
 /*!
  * This function stops any buffers that are currently playing and closes the
  * stream. This function should be called while holding p->mutex.
@@ -570,34 +542,16 @@ static void mus_close_stream(struct mus_player* p) {
 void mus_score_close(DJ_HANDLE h) {
 	struct mus_player* p = NULL;
 
-	WaitForSingleObject(players_mutex, INFINITE);
-	if (mus_is_handle_valid(h) == false) {
-		ReleaseMutex(players_mutex);
+	// Freeing the handle waits for any call still using it to finish. Any
+	// further calls using this handle will return MMSYSERR_INVALPARAM.
+	p = (struct mus_player*)dj_handle_free(h, DJ_HANDLE_MUS);
+	if (p == NULL)
 		return;
-	}
-
-	p = players;
-	if (p == h) // if h is the first in the list
-	{
-		players = p->next;
-		p->next = NULL;
-	} else {
-		while (p != NULL) {
-			if (p->next == h) {
-				p->next = p->next->next;
-				p = h;
-				p->next = NULL;
-				break;
-			} else
-				p = p->next;
-		}
-	}
 
+	WaitForSingleObject(players_mutex, INFINITE);
+	mus_remove_player(p);
 	ReleaseMutex(players_mutex);
 
-	// The player has been removed from the global list. Any further calls
-	// using this handle will return MMSYSERR_INVALPARAM.
-
 	// Start shutting down the thread. If it's still playing, stop it.
 	WaitForSingleObject(p->mutex, INFINITE);
 	if (p->state != STATE_STOPPED) {
@@ -624,18 +578,14 @@ void mus_score_close(DJ_HANDLE h) {
 }
 
 DJ_RESULT mus_play(DJ_HANDLE h) {
-	struct mus_player* p = (struct mus_player*)h;
+	struct mus_player* p = (struct mus_player*)dj_handle_acquire(h, DJ_HANDLE_MUS);
 	unsigned int err = MMSYSERR_NOERROR;
 	MIDIPROPTIMEDIV prop;
 
-	WaitForSingleObject(players_mutex, INFINITE);
-	if (mus_is_handle_valid(h) == false) {
-		ReleaseMutex(players_mutex);
+	if (p == NULL)
 		return MMSYSERR_INVALPARAM;
-	}
 
 	WaitForSingleObject(p->mutex, INFINITE);
-	ReleaseMutex(players_mutex);
 
 	if (p->state == STATE_STOPPED) {
 		err = midiStreamOpen(&p->stream, &p->device, 1, (DWORD_PTR)mus_callback_proc, (DWORD_PTR)p, CALLBACK_FUNCTION);
@@ -697,22 +647,19 @@ DJ_RESULT mus_play(DJ_HANDLE h) {
 
 error:
 	ReleaseMutex(p->mutex);
+	dj_handle_release(h);
 
 	return err;
 }
 
 DJ_RESULT mus_stop(DJ_HANDLE h) {
-	struct mus_player* p = (struct mus_player*)h;
+	struct mus_player* p = (struct mus_player*)dj_handle_acquire(h, DJ_HANDLE_MUS);
 	unsigned int err = MMSYSERR_NOERROR;
 
-	WaitForSingleObject(players_mutex, INFINITE);
-	if (mus_is_handle_valid(h) == false) {
-		ReleaseMutex(players_mutex);
+	if (p == NULL)
 		return MMSYSERR_INVALPARAM;
-	}
 
 	WaitForSingleObject(p->mutex, INFINITE);
-	ReleaseMutex(players_mutex);
 	if (p->state != STATE_STOPPED) {
 		ResetEvent(p->ready);
 
@@ -725,21 +672,19 @@ DJ_RESULT mus_stop(DJ_HANDLE h) {
 	} else
 		ReleaseMutex(p->mutex);
 
+	dj_handle_release(h);
+
 	return MMSYSERR_NOERROR;
 }
 
 DJ_RESULT mus_pause(DJ_HANDLE h) {
-	struct mus_player* p = (struct mus_player*)h;
+	struct mus_player* p = (struct mus_player*)dj_handle_acquire(h, DJ_HANDLE_MUS);
 	unsigned int err = MMSYSERR_NOERROR;
 
-	WaitForSingleObject(players_mutex, INFINITE);
-	if (mus_is_handle_valid(h) == false) {
-		ReleaseMutex(players_mutex);
+	if (p == NULL)
 		return MMSYSERR_INVALPARAM;
-	}
 
 	WaitForSingleObject(p->mutex, INFINITE);
-	ReleaseMutex(players_mutex);
 	if (p->state == STATE_PLAYING) {
 		err = midiStreamPause(p->stream);
 		if (err == MMSYSERR_NOERROR)
@@ -750,22 +695,19 @@ DJ_RESULT mus_pause(DJ_HANDLE h) {
 		}
 	}
 	ReleaseMutex(p->mutex);
+	dj_handle_release(h);
 
 	return err;
 }
 
 DJ_RESULT mus_resume(DJ_HANDLE h) {
-	struct mus_player* p = (struct mus_player*)h;
+	struct mus_player* p = (struct mus_player*)dj_handle_acquire(h, DJ_HANDLE_MUS);
 	unsigned int err = MMSYSERR_NOERROR;
 
-	WaitForSingleObject(players_mutex, INFINITE);
-	if (mus_is_handle_valid(h) == false) {
-		ReleaseMutex(players_mutex);
+	if (p == NULL)
 		return MMSYSERR_INVALPARAM;
-	}
 
 	WaitForSingleObject(p->mutex, INFINITE);
-	ReleaseMutex(players_mutex);
 	if (p->state == STATE_PAUSED) {
 		err = midiStreamRestart(p->stream);
 		if (err == MMSYSERR_NOERROR)
@@ -776,24 +718,23 @@ DJ_RESULT mus_resume(DJ_HANDLE h) {
 		}
 	}
 	ReleaseMutex(p->mutex);
+	dj_handle_release(h);
 
 	return err;
 }
 
 DJ_RESULT mus_set_volume_left(DJ_HANDLE h, unsigned int level) {
 	unsigned int old = 0, vol = 0;
-	struct mus_player* p = (struct mus_player*)h;
+	struct mus_player* p = (struct mus_player*)dj_handle_acquire(h, DJ_HANDLE_MUS);
 	unsigned int err = MMSYSERR_NOERROR;
 	HMIDISTRM stream = (HMIDISTRM)0;
 	boolean valid = false;
 
-	WaitForSingleObject(players_mutex, INFINITE);
-	valid = mus_is_handle_valid(h);
+	valid = (p != NULL);
 	if (valid == true) {
 		stream = p->stream;
 		WaitForSingleObject(p->mutex, INFINITE);
 	}
-	ReleaseMutex(players_mutex);
 
 	err = midiOutGetVolume((HMIDIOUT)stream, (LPDWORD)&old);
 	if (err == MMSYSERR_NOERROR) {
@@ -801,26 +742,26 @@ DJ_RESULT mus_set_volume_left(DJ_HANDLE h, unsigned int level) {
 		err = midiOutSetVolume((HMIDIOUT)stream, vol);
 	}
 
-	if (valid == true)
+	if (valid == true) {
 		ReleaseMutex(p->mutex);
+		dj_handle_release(h);
+	}
 
 	return err;
 }
 
 DJ_RESULT mus_set_volume_right(DJ_HANDLE h, unsigned int level) {
 	unsigned int old = 0, vol = 0;
-	struct mus_player* p = (struct mus_player*)h;
+	struct mus_player* p = (struct mus_player*)dj_handle_acquire(h, DJ_HANDLE_MUS);
 	unsigned int err = MMSYSERR_NOERROR;
 	HMIDISTRM stream = (HMIDISTRM)0;
 	boolean valid = false;
 
-	WaitForSingleObject(players_mutex, INFINITE);
-	valid = mus_is_handle_valid(h);
+	valid = (p != NULL);
 	if (valid == true) {
 		stream = p->stream;
 		WaitForSingleObject(p->mutex, INFINITE);
 	}
-	ReleaseMutex(players_mutex);
 
 	err = midiOutGetVolume((HMIDIOUT)stream, (LPDWORD)&old);
 	if (err == MMSYSERR_NOERROR) {
@@ -828,8 +769,10 @@ DJ_RESULT mus_set_volume_right(DJ_HANDLE h, unsigned int level) {
 		err = midiOutSetVolume((HMIDIOUT)stream, vol);
 	}
 
-	if (valid == true)
+	if (valid == true) {
 		ReleaseMutex(p->mutex);
+		dj_handle_release(h);
+	}
 
 	return err;
 }
@@ -847,18 +790,16 @@ DJ_RESULT mus_set_volume(DJ_HANDLE h, unsigned int level) {
 DJ_RESULT mus_volume_left(DJ_HANDLE h, unsigned int dir) {
 	unsigned int old = 0, vol = 0;
 	const unsigned int val = 3277;
-	struct mus_player* p = (struct mus_player*)h;
+	struct mus_player* p = (struct mus_player*)dj_handle_acquire(h, DJ_HANDLE_MUS);
 	unsigned int err = MMSYSERR_NOERROR;
 	HMIDISTRM stream = (HMIDISTRM)MIDI_MAPPER;
 	boolean valid = false;
 
-	WaitForSingleObject(players_mutex, INFINITE);
-	valid = mus_is_handle_valid(h);
+	valid = (p != NULL);
 	if (valid == true) {
 		stream = p->stream;
 		WaitForSingleObject(p->mutex, INFINITE);
 	}
-	ReleaseMutex(players_mutex);
 
 	err = midiOutGetVolume((HMIDIOUT)stream, (LPDWORD)&old);
 	if (err == MMSYSERR_NOERROR) {
@@ -880,8 +821,10 @@ DJ_RESULT mus_volume_left(DJ_HANDLE h, unsigned int dir) {
 		err = midiOutSetVolume((HMIDIOUT)stream, vol);
 	}
 
-	if (valid == true)
+	if (valid == true) {
 		ReleaseMutex(p->mutex);
+		dj_handle_release(h);
+	}
 
 	return err;
 }
@@ -889,18 +832,16 @@ DJ_RESULT mus_volume_left(DJ_HANDLE h, unsigned int dir) {
 DJ_RESULT mus_volume_right(DJ_HANDLE h, unsigned int dir) {
 	unsigned int old = 0, vol = 0;
 	const unsigned int val = 3277;
-	struct mus_player* p = (struct mus_player*)h;
+	struct mus_player* p = (struct mus_player*)dj_handle_acquire(h, DJ_HANDLE_MUS);
 	unsigned int err = MMSYSERR_NOERROR;
 	HMIDISTRM stream = (HMIDISTRM)MIDI_MAPPER;
 	boolean valid = false;
 
-	WaitForSingleObject(players_mutex, INFINITE);
-	valid = mus_is_handle_valid(h);
+	valid = (p != NULL);
 	if (valid == true) {
 		stream = p->stream;
 		WaitForSingleObject(p->mutex, INFINITE);
 	}
-	ReleaseMutex(players_mutex);
 
 	err = midiOutGetVolume((HMIDIOUT)stream, (LPDWORD)&old);
 	if (err == MMSYSERR_NOERROR) {
@@ -922,8 +863,10 @@ DJ_RESULT mus_volume_right(DJ_HANDLE h, unsigned int dir) {
 		err = midiOutSetVolume((HMIDIOUT)stream, vol);
 	}
 
-	if (valid == true)
+	if (valid == true) {
 		ReleaseMutex(p->mutex);
+		dj_handle_release(h);
+	}
 
 	return err;
 }
@@ -939,84 +882,75 @@ DJ_RESULT mus_volume(DJ_HANDLE h, unsigned int dir) {
 }
 
 DJ_RESULT mus_set_looping(DJ_HANDLE h, boolean looping) {
-	struct mus_player* p = (struct mus_player*)h;
+	struct mus_player* p = (struct mus_player*)dj_handle_acquire(h, DJ_HANDLE_MUS);
 	unsigned int err = MMSYSERR_NOERROR;
 
-	WaitForSingleObject(players_mutex, INFINITE);
-	if (mus_is_handle_valid(h) == false) {
-		ReleaseMutex(players_mutex);
+	if (p == NULL)
 		return MMSYSERR_INVALPARAM;
-	}
 
 	WaitForSingleObject(p->mutex, INFINITE);
-	ReleaseMutex(players_mutex);
 
 	p->looping = looping;
 
 	ReleaseMutex(p->mutex);
+	dj_handle_release(h);
 
 	return MMSYSERR_NOERROR;
 }
 
 boolean mus_is_looping(DJ_HANDLE h) {
-	struct mus_player* p = (struct mus_player*)h;
+	struct mus_player* p = (struct mus_player*)dj_handle_acquire(h, DJ_HANDLE_MUS);
 	unsigned int err = MMSYSERR_NOERROR;
 	boolean looping;
 
-	WaitForSingleObject(players_mutex, INFINITE);
-	if (mus_is_handle_valid(h) == false) {
-		ReleaseMutex(players_mutex);
+	if (p == NULL)
 		return false;
-	}
 
 	WaitForSingleObject(p->mutex, INFINITE);
-	ReleaseMutex(players_mutex);
 
 	looping = p->looping;
 
 	ReleaseMutex(p->mutex);
+	dj_handle_release(h);
 
 	return looping;
 }
 
 boolean mus_is_playing(DJ_HANDLE h) {
-	struct mus_player* p = (struct mus_player*)h;
+	struct mus_player* p = (struct mus_player*)dj_handle_acquire(h, DJ_HANDLE_MUS);
 	boolean ret = false;
 
-	WaitForSingleObject(players_mutex, INFINITE);
-	if (mus_is_handle_valid(h) == false)
-		ret = false;
-	else
-		ret = (p->state == STATE_PLAYING);
-	ReleaseMutex(players_mutex);
+	if (p == NULL)
+		return false;
+
+	ret = (p->state == STATE_PLAYING);
+	dj_handle_release(h);
 
 	return ret;
 }
 
 boolean mus_is_paused(DJ_HANDLE h) {
-	struct mus_player* p = (struct mus_player*)h;
+	struct mus_player* p = (struct mus_player*)dj_handle_acquire(h, DJ_HANDLE_MUS);
 	boolean ret = false;
 
-	WaitForSingleObject(players_mutex, INFINITE);
-	if (mus_is_handle_valid(h) == false)
-		ret = false;
-	else
-		ret = (p->state == STATE_PAUSED);
-	ReleaseMutex(players_mutex);
+	if (p == NULL)
+		return false;
+
+	ret = (p->state == STATE_PAUSED);
+	dj_handle_release(h);
 
 	return ret;
 }
 
 boolean mus_is_stopped(DJ_HANDLE h) {
-	struct mus_player* p = (struct mus_player*)h;
+	struct mus_player* p = (struct mus_player*)dj_handle_acquire(h, DJ_HANDLE_MUS);
 	boolean ret = false;
 
-	WaitForSingleObject(players_mutex, INFINITE);
-	if (mus_is_handle_valid(h) == false)
-		ret = false;
-	else
-		ret = (p->state == STATE_STOPPED);
-	ReleaseMutex(players_mutex);
+	if (p == NULL)
+		return false;
+
+	ret = (p->state == STATE_STOPPED);
+	dj_handle_release(h);
 
 	return ret;
 }
@@ -0,0 +1,181 @@
+/*
+ * DjMM
+ * v0.1
+ *
+ * Copyright (c) 2011, David J. Rager
+ * djrager@fourthwoods.com
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * pcm_adpcm.c
+ *
+ *  Created on: Oct 16, 2026
+ *      Author: David J. Rager
+ *       Email: djrager@fourthwoods.com
+ */
+#include <string.h>
+
+#include "pcm_adpcm.h"
+
+static const short step_table[89] = {
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+  19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+  50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+  130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+  337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+  876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+  2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+  5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+  15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const signed char index_table[16] = {
+  -1, -1, -1, -1, 2, 4, 6, 8,
+  -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+struct adpcm_state {
+  int predictor;
+  int index;
+};
+
+/*
+ * Moves the state on by one code, exactly as the decoder will, and returns
+ * the new sample.
+ */
+static short adpcm_step(struct adpcm_state* st, unsigned int code) {
+  int step = step_table[st->index];
+  int delta = step >> 3;
+
+  if (code & 4)
+    delta += step;
+  if (code & 2)
+    delta += step >> 1;
+  if (code & 1)
+    delta += step >> 2;
+
+  if (code & 8)
+    st->predictor -= delta;
+  else
+    st->predictor += delta;
+
+  if (st->predictor > 32767)
+    st->predictor = 32767;
+  else if (st->predictor < -32768)
+    st->predictor = -32768;
+
+  st->index += index_table[code];
+  if (st->index < 0)
+    st->index = 0;
+  else if (st->index > 88)
+    st->index = 88;
+
+  return (short)st->predictor;
+}
+
+static unsigned int adpcm_code(const struct adpcm_state* st, int sample) {
+  int step = step_table[st->index];
+  int diff = sample - st->predictor;
+  unsigned int code = 0;
+
+  if (diff < 0) {
+    code = 8;
+    diff = -diff;
+  }
+
+  if (diff >= step) {
+    code |= 4;
+    diff -= step;
+  }
+  step >>= 1;
+  if (diff >= step) {
+    code |= 2;
+    diff -= step;
+  }
+  step >>= 1;
+  if (diff >= step)
+    code |= 1;
+
+  return code;
+}
+
+unsigned int pcm_adpcm_size(unsigned int channels, unsigned int frames) {
+  unsigned int blocks = (frames + PCM_ADPCM_BLOCK_FRAMES - 1) / PCM_ADPCM_BLOCK_FRAMES;
+  return blocks * PCM_ADPCM_BLOCK_BYTES(channels);
+}
+
+void pcm_adpcm_encode(unsigned char* out, const short* in, unsigned int channels, unsigned int frames) {
+  struct adpcm_state st[2] = { { 0, 0 }, { 0, 0 } };
+  unsigned int first, c, i;
+
+  for (first = 0; first < frames; first += PCM_ADPCM_BLOCK_FRAMES) {
+    struct pcm_adpcm_header* hdr = (struct pcm_adpcm_header*)out;
+    unsigned char* data = out + channels * sizeof(struct pcm_adpcm_header);
+
+    for (c = 0; c < channels; c++) {
+      hdr[c].predictor = (short)st[c].predictor;
+      hdr[c].index = (unsigned char)st[c].index;
+      hdr[c].reserved = 0;
+    }
+
+    memset(data, 0, channels * PCM_ADPCM_BLOCK_FRAMES / 2);
+
+    for (c = 0; c < channels; c++) {
+      unsigned char* nibbles = data + c * PCM_ADPCM_BLOCK_FRAMES / 2;
+
+      for (i = 0; i < PCM_ADPCM_BLOCK_FRAMES; i++) {
+        int sample = first + i < frames ? in[(first + i) * channels + c] : 0;
+        unsigned int code = adpcm_code(&st[c], sample);
+
+        adpcm_step(&st[c], code);
+        nibbles[i >> 1] |= (unsigned char)(code << ((i & 1) * 4));
+      }
+    }
+
+    out += PCM_ADPCM_BLOCK_BYTES(channels);
+  }
+}
+
+void pcm_adpcm_decode(short* out, const unsigned char* in, unsigned int channels, unsigned int block) {
+  const struct pcm_adpcm_header* hdr;
+  const unsigned char* data;
+  unsigned int c, i;
+
+  in += (size_t)block * PCM_ADPCM_BLOCK_BYTES(channels);
+  hdr = (const struct pcm_adpcm_header*)in;
+  data = in + channels * sizeof(struct pcm_adpcm_header);
+
+  for (c = 0; c < channels; c++) {
+    const unsigned char* nibbles = data + c * PCM_ADPCM_BLOCK_FRAMES / 2;
+    struct adpcm_state st;
+    short* dst = out + c;
+
+    st.predictor = hdr[c].predictor;
+    st.index = hdr[c].index;
+
+    for (i = 0; i < PCM_ADPCM_BLOCK_FRAMES / 2; i++) {
+      unsigned int b = nibbles[i];
+
+      dst[0] = adpcm_step(&st, b & 0x0f);
+      dst[channels] = adpcm_step(&st, b >> 4);
+      dst += channels * 2;
+    }
+  }
+}
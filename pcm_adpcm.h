@@ -0,0 +1,82 @@
+/*
+ * DjMM
+ * v0.1
+ *
+ * Copyright (c) 2011, David J. Rager
+ * djrager@fourthwoods.com
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * pcm_adpcm.h
+ *
+ *  Created on: Oct 16, 2026
+ *      Author: David J. Rager
+ *       Email: djrager@fourthwoods.com
+ */
+
+#ifndef PCM_ADPCM_H_
+#define PCM_ADPCM_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * IMA ADPCM, 4 bits per sample, in blocks of PCM_ADPCM_BLOCK_FRAMES frames
+ * that decode on their own. A block holds a header per channel, the decoder
+ * state going into the block, followed by each channel's samples two to a
+ * byte, the earlier sample in the low nibble. The last block is padded out
+ * with silence.
+ *
+ * The format only lives in memory, the header is in the machine's byte
+ * order.
+ */
+#define PCM_ADPCM_BLOCK_FRAMES	256
+
+struct pcm_adpcm_header {
+  short predictor;
+  unsigned char index;
+  unsigned char reserved;
+};
+
+#define PCM_ADPCM_BLOCK_BYTES(channels)	((channels) * (sizeof(struct pcm_adpcm_header) + PCM_ADPCM_BLOCK_FRAMES / 2))
+
+/*
+ * Number of bytes pcm_adpcm_encode() writes for frames frames.
+ */
+unsigned int pcm_adpcm_size(unsigned int channels, unsigned int frames);
+
+/*
+ * Encodes frames interleaved s16 frames into out, which must hold
+ * pcm_adpcm_size() bytes.
+ */
+void pcm_adpcm_encode(unsigned char* out, const short* in, unsigned int channels, unsigned int frames);
+
+/*
+ * Decodes block number block of the encoded data into
+ * PCM_ADPCM_BLOCK_FRAMES interleaved s16 frames.
+ */
+void pcm_adpcm_decode(short* out, const unsigned char* in, unsigned int channels, unsigned int block);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PCM_ADPCM_H_ */
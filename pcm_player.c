@@ -31,11 +31,18 @@
  *       Email: djrager@fourthwoods.com
  */
 #include <stdio.h>
+#include <math.h>
 #include <conio.h>
 #include <windows.h>
 
 #include "SDL3/sdl.h"
 #include "pcm_player.h"
+#include "pcm_adpcm.h"
+#include "pcm_simd.h"
+#include "pcm_resample.h"
+#include "pcm_ring.h"
+#include "pcm_stream.h"
+#include "djmm_handle.h"
 
 #define STATE_ERROR		0
 #define STATE_STARTING	1
@@ -63,32 +70,99 @@ unsigned char* load_file(unsigned char* filename, unsigned int* len);
 #endif
 
 struct pcm_player {
-  HANDLE mutex;
+  DJ_HANDLE handle; // registry handle given to the user
 
-  unsigned int device;
-
-  unsigned int state;
   unsigned int looping;
   unsigned int lvolume;
   unsigned int rvolume;
 
+  // The values the audio thread mixes with. They are only changed by
+  // commands from the ring so a new setting starts on a block boundary.
+  unsigned int mix_looping;
+  unsigned int mix_lvolume;
+  unsigned int mix_rvolume;
+  unsigned int mix_bus;
+
+  unsigned int bus;
+  unsigned int step; // source frames per mixer frame, 16.16 fixed point
+
   struct pcm_sample* sample;
   pcm_notify_cb cb;
 
   struct pcm_player* next;
 };
 
+/*
+ * Decoded sample data. A sample is never modified after it is created so it
+ * can be shared by the player that loaded it and by every voice playing it.
+ * The sample is freed when the last reference is released.
+ */
 struct pcm_sample {
+  volatile LONG refs;
+
   unsigned int sample_rate;
-  unsigned int sample_size;
+  unsigned int sample_size; // bits, 4 is IMA ADPCM
   unsigned int sample_count;
   unsigned int channels;
-  unsigned int silence;
-
-  unsigned char* ptr;
 
   unsigned char* raw_bytes;
   unsigned int raw_len;
+
+  unsigned int owns_bytes; // false if raw_bytes points into the caller's buffer
+
+  struct pcm_stream* stream; // read from a file as it plays, no raw_bytes
+};
+
+/*
+ * One playing instance of a sample. Voices are allocated from a fixed pool
+ * so a sound can be started many times without copying its sample data.
+ *
+ * The API thread that claims a voice sets it up in STATE_STARTING. From the
+ * moment the audio thread applies its play command the voice belongs to the
+ * audio thread, which frees it when it stops.
+ */
+struct pcm_voice {
+  volatile LONG claimed;
+  PCM_VOICE id; // serial << 8 | slot, 0 while the voice is free
+  unsigned int serial;
+
+  unsigned int priority;
+  unsigned int heap_index;  // position in the mixer's voice heap
+  unsigned long long end;   // mixer frame the voice runs out on
+  unsigned int loudness;    // louder channel with its handle and bus settings
+
+  unsigned long long start;  // mixer frame to start on, 0 to start right away
+  struct pcm_voice* group;   // next voice started by the same play command
+
+  unsigned int state;
+  unsigned int lvolume;
+  unsigned int rvolume;
+
+  unsigned int pos;  // read position in frames
+  unsigned int anchor; // stream frame of the sample's first frame on this pass
+  unsigned int frac; // fractional part of the read position, 16.16 fixed point
+  unsigned int step; // source frames per mixer frame with the voice's pitch applied
+
+  // Set by the audio thread while the voice is too quiet to hear. Virtual
+  // voices only move their read position, nothing is fetched or mixed.
+  unsigned int virt;
+
+  // Set by whichever thread mixed the voice when it runs out during a
+  // block, with the mixer frame after its last sample. The audio thread
+  // frees it once the block is mixed.
+  unsigned int ended;
+  unsigned long long ended_at;
+
+  // Filter picked up from pcm_voice_set_filters() and the biquad worked out
+  // from it. The state carries over from one block to the next.
+  unsigned int filter;
+  unsigned int cutoff;
+  float coef[5]; // b0, b1, b2, a1, a2
+  float z1[2];   // left, right
+  float z2[2];
+
+  struct pcm_sample* sample;
+  struct pcm_player* owner;
 };
 
 #pragma pack(push,1)
@@ -102,34 +176,380 @@ struct dmx_header {
 };
 #pragma pack(pop)
 
-#define MAX_BUFFER_SIZE	1024 / 2
+// Largest block the mixer renders in one pass. The device period is set
+// separately and longer periods are mixed in several blocks.
+#define MAX_BUFFER_SIZE	(1024 / 2)
+
+// Device period the mixer opens with unless pcm_set_latency() says
+// otherwise, and how long adaptive mode waits with every callback well
+// inside its budget before it tries a shorter one.
+#define PCM_DEFAULT_PERIOD	MAX_BUFFER_SIZE
+#define PCM_ADAPT_SECONDS	5
+
+#define PCM_MIXER_RATE		44100
+#define PCM_MIXER_CHANNELS	2
+
+// Voice slots, more than the default voice budget so plays can still claim
+// a slot and compete for the budget when it is full.
+#define PCM_MAX_VOICES		256
+#define PCM_DEFAULT_VOICES	64
+#define PCM_NO_HEAP			0xffffffff
+
+// Default distance model in map units, full volume inside the near distance
+// and silent beyond the far one, the same as Doom's S_CLOSE_DIST and
+// S_CLIPPING_DIST.
+#define PCM_DEFAULT_NEAR	160.0f
+#define PCM_DEFAULT_FAR		1200.0f
+
+// Music ducks by 12 dB under dialogue, quickly in and slowly out.
+#define PCM_DEFAULT_DUCK_DEPTH		0x4000
+#define PCM_DEFAULT_DUCK_ATTACK		50
+#define PCM_DEFAULT_DUCK_RELEASE	500
+
+// Master stage. The limiter looks ahead one segment of 64 frames and works
+// out its gain once per segment. With the soft clipper on it holds the mix
+// to 1.4x full scale, which the clipper bends down to about 0.95x.
+#define PCM_LIMITER_LOOKAHEAD	64
+#define PCM_LIMITER_CEILING		45875
+#define PCM_LIMITER_RELEASE		200 // ms from full reduction back to unity
+#define PCM_SOFTCLIP_KNEE		26214
+#define PCM_SOFTCLIP_CEILING	32767
+#define PCM_VOICE_SLOT(v)	((v) & 0xff)
+
+// Commands queued for the audio thread. Voice commands name the voice in
+// pcm_command.voice, player commands name the player in pcm_command.target.
+#define PCM_CMD_VOICE_PLAY		1
+#define PCM_CMD_VOICE_STOP		2
+#define PCM_CMD_VOICE_VOLUME	3 // a = left, b = right
+#define PCM_CMD_PAUSE			4
+#define PCM_CMD_RESUME			5
+#define PCM_CMD_STOP			6
+#define PCM_CMD_VOLUME_LEFT		7 // a = level
+#define PCM_CMD_VOLUME_RIGHT	8 // a = level
+#define PCM_CMD_LOOPING			9 // a = looping
+#define PCM_CMD_MAX_VOICES		10 // a = count
+#define PCM_CMD_VOICE_PITCH		11 // a = rate
+#define PCM_CMD_BUS				12 // a = bus
+#define PCM_CMD_BUS_VOLUME		13 // a = bus, b = level
+#define PCM_CMD_BUS_MUTE		14 // a = bus, b = mute
+#define PCM_CMD_BUS_DUCKING		15 // a = bus, settings in the bus's API side fields
+#define PCM_CMD_MASTER			16 // a = flags
+
+// Largest source span stepped over by one voice per pass. Allows sample rates
+// up to 4x the mixer rate without splitting a block into many passes.
+#define PCM_SCRATCH_FRAMES	(MAX_BUFFER_SIZE * 4)
+
+// Source frames fetched per pass, including the resampling filter's reach on
+// either side of the span.
+#define PCM_FETCH_FRAMES	(PCM_SCRATCH_FRAMES + PCM_RESAMPLE_HISTORY + PCM_RESAMPLE_LOOKAHEAD)
+
+#define PCM_CACHE_LINE		64
+
+// Lowest and highest filter cutoffs, the highest as a share of the mixer
+// rate.
+#define PCM_FILTER_MIN_CUTOFF	20
+#define PCM_FILTER_MAX_CUTOFF	0.45
+
+// Filter state below this, far under one sample step, is taken to be
+// silence so it never decays into denormals.
+#define PCM_FILTER_FLOOR	1e-3f
+
+/*
+ * Scratch space for one mixing thread. Helper threads sum their share of the
+ * voices into their own accum, which the audio thread adds into the mix.
+ * Helper contexts are allocated on cache line boundaries, with the fields
+ * written per voice first, so threads never write to the same line.
+ */
+struct pcm_mix_ctx {
+  unsigned int mixed;
+  unsigned int active[PCM_BUSES]; // voices mixed per bus
+
+  int accum[MAX_BUFFER_SIZE * PCM_MIXER_CHANNELS];
+  short voice[MAX_BUFFER_SIZE * PCM_MIXER_CHANNELS];
+  short wide[PCM_FETCH_FRAMES * 2];
+
+  // Filtered voices are mixed on their own into dry, then copied into the
+  // next lane of wet. The bank runs once all its lanes are taken, and at
+  // the end of the share for the rest.
+  int dry[MAX_BUFFER_SIZE * PCM_MIXER_CHANNELS];
+  float wet[MAX_BUFFER_SIZE * PCM_MIXER_CHANNELS * PCM_FILTER_LANES];
+  struct pcm_biquad_bank bank;
+  struct pcm_voice* lane[PCM_FILTER_LANES];
+  unsigned int lanes;
+
+  void* block; // what was allocated, the context starts on the next line
+};
+
+/*
+ * Helper threads for mixing. Each block the audio thread lists the playing
+ * voices and, when enough of them are audible, hands a contiguous share of
+ * the list to each helper and mixes the first share itself.
+ */
+struct pcm_workers {
+  unsigned int count;
+  unsigned int threshold; // audible voices needed to split a block
+  volatile LONG quit;
+
+  HANDLE thread[PCM_MAX_MIX_THREADS];
+  HANDLE start[PCM_MAX_MIX_THREADS]; // auto-reset, a block is ready
+  HANDLE done[PCM_MAX_MIX_THREADS];  // auto-reset, the share is mixed
+  struct pcm_mix_ctx* ctx[PCM_MAX_MIX_THREADS];
+
+  // The current block, written by the audio thread before it sets start.
+  unsigned int frames;
+  unsigned int voices;
+  unsigned int list[PCM_MAX_VOICES];
+  unsigned int first[PCM_MAX_MIX_THREADS + 2]; // share k is list[first[k]] up to list[first[k + 1]]
+};
+
+/*
+ * All open sounds share a single output stream. The device is opened once by
+ * pcm_init() and _pcm_audio_callback() sums every playing voice into it, so
+ * the number of OS audio streams does not grow with the number of sounds.
+ */
+struct pcm_mixer {
+  volatile LONG initialized; // pcm_init_ex() has opened a backend
+  unsigned int backend;
+  SDL_AudioDeviceID device;
+
+  // Stands in for the device lock with PCM_BACKEND_NULL, held while
+  // pcm_render_wav() runs the callback.
+  HANDLE render_mutex;
+
+  // Held while the device is locked or being reopened at a new period.
+  HANDLE device_mutex;
+
+  unsigned int rate;
+  unsigned int channels;
+
+  // Voices are mixed after the first PCM_LIMITER_LOOKAHEAD frames, which
+  // hold the end of the previous block while the limiter is on.
+  int accum[(PCM_LIMITER_LOOKAHEAD + MAX_BUFFER_SIZE) * PCM_MIXER_CHANNELS];
+
+  unsigned int resample_mode;
+
+  const struct pcm_kernels* kernels;
+
+  // API threads never touch voice or player mix state directly, they queue
+  // commands here for the callback to apply before its next block.
+  struct pcm_ring commands;
+
+  // Started voices as a min heap, least important first, so the voice to
+  // steal when the budget is full is always heap[0].
+  struct pcm_voice* heap[PCM_MAX_VOICES];
+  unsigned int heap_size;
+  unsigned int max_voices;
+
+  unsigned long long frame; // mixer frames rendered so far
+  volatile LONGLONG clock;  // copy of frame for the API threads
+
+  // Voice positions and the stereo gains worked out from them, by voice
+  // slot. Kept as separate arrays so one kernel call covers every slot.
+  float pos_x[PCM_MAX_VOICES];
+  float pos_y[PCM_MAX_VOICES];
+  unsigned int pan_lgain[PCM_MAX_VOICES];
+  unsigned int pan_rgain[PCM_MAX_VOICES];
+  float near_dist;
+  float far_dist;
+  unsigned int pan_dirty; // positions changed since the gains were computed
+
+  unsigned int master;  // PCM_MASTER_* stages the callback runs
+  float limiter_gain;   // gain the limiter reached at the end of the last block
+};
+
+/*
+ * Positions and filters posted by the API threads for the callback to pick
+ * up. An API thread holds busy while it writes a batch. The callback only
+ * tries for it and leaves the batch for the next block if it is taken, so
+ * it never waits.
+ */
+struct pcm_positions {
+  volatile LONG busy;
+  volatile LONG dirty;
+
+  PCM_VOICE id[PCM_MAX_VOICES]; // 0 if the slot has no new position
+  float x[PCM_MAX_VOICES];
+  float y[PCM_MAX_VOICES];
+
+  PCM_VOICE filter_id[PCM_MAX_VOICES]; // 0 if the slot has no new filter
+  unsigned int filter[PCM_MAX_VOICES];
+  unsigned int cutoff[PCM_MAX_VOICES];
+
+  float near_dist;
+  float far_dist;
+};
+
+/*
+ * A submix bus. The audio thread works out each bus's gain once per block and
+ * folds it into the gains of the voices playing through it.
+ *
+ * The ducking settings are written by pcm_bus_set_ducking() before it queues
+ * PCM_CMD_BUS_DUCKING, which copies them to the mix side.
+ */
+struct pcm_bus {
+  unsigned int storage; // open flags for sounds opened on the bus
+  unsigned int sidechain;
+  unsigned int depth;
+  unsigned int attack_ms;
+  unsigned int release_ms;
+
+  unsigned int mix_volume;
+  unsigned int mix_mute;
+  unsigned int mix_sidechain;
+  unsigned int mix_depth;
+  unsigned int mix_attack_ms;
+  unsigned int mix_release_ms;
+
+  unsigned int duck;   // current ducking gain, 16.16 fixed point
+  unsigned int active; // voices mixed through the bus this block
+  unsigned int gain;   // volume, mute and ducking for this block, 16.16
+};
+
+/*
+ * Completion events travel from the audio thread to the application through
+ * their own ring so user code never runs inside the device callback. The
+ * ring is drained by pcm_poll_events(), either called by the application or
+ * by the dispatcher thread.
+ */
+struct pcm_events {
+  struct pcm_ring ring;
+  HANDLE ready;       // auto-reset, set after a block that queued events
+  unsigned int queued; // events queued during the current block
+  volatile LONG busy; // a thread is draining the ring
+
+  unsigned int mode;
+  HANDLE thread;
+  volatile LONG quit;
+};
+
+/*
+ * Device period. In adaptive mode the callback times itself and asks for a
+ * longer or shorter period through wanted. It never touches the device, it
+ * wakes the latency thread to reopen it.
+ */
+struct pcm_latency {
+  unsigned int adaptive;
+  unsigned int requested;  // period asked for, used by pcm_init_ex()
+  unsigned int period;     // frames per callback the device was opened with
+  volatile LONG wanted;    // period the callback would like, 0 for no change
+  volatile LONG interval;  // measured time between callbacks, microseconds
+  volatile LONG resizes;
+  volatile LONG lost;      // no period would open, the mixer fell back to PCM_BACKEND_NULL
+
+  HANDLE thread; // reopens the device, started with the first adaptive period
+  HANDLE wake;   // auto-reset, wanted was set
+  volatile LONG quit;
+
+  unsigned int clean;      // frames rendered well inside budget since the last change
+  LONGLONG last_start;
+};
+
+/*
+ * Callback timing. Only the audio thread writes the counters. Readers copy
+ * them under a sequence count which is odd while an update is in progress.
+ */
+struct pcm_telemetry {
+  volatile LONG enabled;
+  volatile LONG reset; // clear the counters before the next update
+  volatile LONG seq;
+
+  LARGE_INTEGER freq;
+  LONGLONG last_start;
+
+  struct pcm_stats stats;
+};
 
 static void _pcm_audio_callback(void* userdata, Uint8* stream, int len);
+static unsigned int _pcm_voice_render(struct pcm_voice* v, struct pcm_mix_ctx* ctx, int* accum, unsigned int frames);
+static unsigned int _pcm_voice_mix(struct pcm_voice* v, struct pcm_mix_ctx* ctx, int* accum, unsigned int frames);
+static unsigned int _pcm_voice_filter(struct pcm_voice* v, struct pcm_mix_ctx* ctx, int* accum, unsigned int frames);
+static void _pcm_filter_bank_run(struct pcm_mix_ctx* ctx, int* accum, unsigned int frames);
+static void _pcm_filter_design(struct pcm_voice* v);
+static void _pcm_voice_skip(struct pcm_voice* v, unsigned long long at, unsigned int frames);
+static void _pcm_voice_end_of_sample(struct pcm_voice* v);
 
 static struct pcm_player* _pcm_player_load(pcm_notify_cb callback);
 static void _pcm_player_unload(struct pcm_player* p);
 
 static struct pcm_player* _pcm_player_list_add(struct pcm_player* p);
-static struct pcm_player* _pcm_player_list_remove(DJ_HANDLE h);
+static struct pcm_player* _pcm_player_list_remove(struct pcm_player* p);
 
 static void _pcm_player_free(struct pcm_player* p);
 
-static struct pcm_sample* _pcm_sample_create(unsigned char* buf, unsigned int len);
-static void _pcm_sample_free(struct pcm_sample* s);
-
-static struct pcm_player* _pcm_stream_open(struct pcm_player* p);
-static void _pcm_stream_close(struct pcm_player* p);
+static struct pcm_sample* _pcm_sample_create(unsigned char* buf, unsigned int len, unsigned int flags);
+static DJ_RESULT _pcm_sample_convert(struct pcm_sample* s);
+static DJ_RESULT _pcm_sample_compress(struct pcm_sample* s);
+static struct pcm_sample* _pcm_sample_stream(const char* filename);
+static struct pcm_sample* _pcm_sample_ref(struct pcm_sample* s);
+static void _pcm_sample_release(struct pcm_sample* s);
+
+static DJ_RESULT _pcm_play(const DJ_HANDLE* handles, unsigned int count, unsigned int priority, unsigned long long start, PCM_VOICE* out);
+
+static struct pcm_voice* _pcm_voice_alloc(struct pcm_player* p, unsigned int priority);
+static void _pcm_voice_free(struct pcm_voice* v);
+static void _pcm_voice_start(struct pcm_voice* v);
+static void _pcm_voice_steal(struct pcm_voice* v);
+static unsigned long long _pcm_voice_end(struct pcm_voice* v);
+static int _pcm_voice_cmp(const struct pcm_voice* a, const struct pcm_voice* b);
+static void _pcm_voice_rekey(struct pcm_voice* v);
+static void _pcm_voices_rekey(struct pcm_player* p, unsigned int bus);
+
+static void _pcm_heap_insert(struct pcm_voice* v);
+static void _pcm_heap_remove(struct pcm_voice* v);
+static void _pcm_heap_update(struct pcm_voice* v);
+static void _pcm_heap_up(unsigned int i);
+static void _pcm_heap_down(unsigned int i);
+static struct pcm_voice* _pcm_voice_lookup(PCM_VOICE id);
+static unsigned int _pcm_player_voice_states(struct pcm_player* p);
+
+static DJ_RESULT _pcm_mixer_open(unsigned int backend);
+static DJ_RESULT _pcm_mixer_open_device(unsigned int period);
+static DJ_RESULT _pcm_mixer_reopen(unsigned int period, boolean adaptive);
+static void _pcm_mixer_close();
+static void _pcm_render(struct pcm_mixer* m, void* out, unsigned int frames, boolean f32);
+static unsigned int _pcm_mix_block(struct pcm_mixer* m, void* out, unsigned int frames, boolean f32);
+static void _pcm_latency_update(LONGLONG start, unsigned int frames);
+static void _pcm_mix_share(struct pcm_mix_ctx* ctx, int* accum, unsigned int share);
+static DWORD WINAPI _pcm_worker_proc(LPVOID param);
+static void _pcm_workers_stop();
+static void _pcm_mixer_lock();
+static void _pcm_mixer_unlock();
+
+static void _pcm_put_le32(unsigned char* out, unsigned int val);
+static void _pcm_put_le16(unsigned char* out, unsigned int val);
+static unsigned int _pcm_mixer_step(unsigned int sample_rate);
 
 static void _pcm_player_pool_add(struct pcm_player* p);
 static struct pcm_player* _pcm_player_pool_remove();
 
-static boolean _pcm_is_handle_valid(DJ_HANDLE h);
+static DJ_RESULT _pcm_command_push(unsigned int type, struct pcm_player* p, PCM_VOICE voice, unsigned int a, unsigned int b);
+static void _pcm_commands_apply();
+static void _pcm_command_apply(const struct pcm_command* cmd);
+
+static void _pcm_telemetry_update(LONGLONG start, unsigned int frames, unsigned int mixed);
+
+static void _pcm_positions_lock();
+static void _pcm_positions_unlock();
+static void _pcm_positions_apply();
+
+static void _pcm_buses_init();
+static void _pcm_buses_update(unsigned int frames);
+
+static int* _pcm_master(int* mix, unsigned int frames);
+static void _pcm_limiter(int* buf, unsigned int frames);
+
+static void _pcm_event_push(unsigned int type, DJ_HANDLE h, PCM_VOICE voice, unsigned long long frame);
+static void _pcm_event_notify(const struct pcm_event* evt);
+static DWORD WINAPI _pcm_dispatch_proc(LPVOID param);
 
-static DJ_RESULT _pcm_lock(DJ_HANDLE h);
-static DJ_RESULT _pcm_unlock(DJ_HANDLE h);
-static DJ_RESULT _pcm_rewind(DJ_HANDLE h);
+static DJ_RESULT _pcm_latency_start();
+static void _pcm_latency_stop();
+static DWORD WINAPI _pcm_latency_proc(LPVOID param);
 
-static unsigned int _pcm_adjust_volume(unsigned char* out, unsigned int len, struct pcm_player* p);
+static boolean _pcm_voice_gain(struct pcm_voice* v, unsigned int* lvol, unsigned int* rvol);
+static unsigned int _pcm_adjust_volume(short* out, unsigned int frames, struct pcm_voice* v);
+static void _pcm_voice_fetch(struct pcm_voice* v, short* dst, int first, unsigned int count);
+static void _pcm_adpcm_fetch(const struct pcm_sample* s, short* dst, unsigned int first, unsigned int count);
 
 static DJ_HANDLE players_mutex = NULL;
 static struct pcm_player* players = NULL;
@@ -137,10 +557,36 @@ static struct pcm_player* players = NULL;
 static DJ_HANDLE pool_mutex = NULL;
 static struct pcm_player* pool = NULL;
 
+static struct pcm_voice voices[PCM_MAX_VOICES];
+static volatile LONG voice_hint = 0; // where the next slot search starts
+
+static struct pcm_mixer mixer;
+static struct pcm_events events;
+static struct pcm_telemetry telemetry;
+static struct pcm_positions positions;
+static struct pcm_bus buses[PCM_BUSES];
+static struct pcm_latency latency = { 0, PCM_DEFAULT_PERIOD };
+static struct pcm_workers workers;
+static struct pcm_mix_ctx main_ctx; // the audio thread's own
+
 DJ_RESULT pcm_init() {
+  return pcm_init_ex(PCM_BACKEND_DEVICE);
+}
+
+DJ_RESULT pcm_init_ex(unsigned int backend) {
+  unsigned int i;
+
+  if (backend != PCM_BACKEND_DEVICE && backend != PCM_BACKEND_NULL)
+    return INVALID_PARAM;
+
   players = NULL;
   pool = NULL;
 
+  memset(voices, 0, sizeof(voices));
+  for (i = 0; i < PCM_MAX_VOICES; i++)
+    voices[i].heap_index = PCM_NO_HEAP;
+  voice_hint = 0;
+
   players_mutex = CreateMutex(NULL, FALSE, NULL);
   if (players_mutex == NULL)
     return ERROR;
@@ -149,14 +595,79 @@ DJ_RESULT pcm_init() {
   if (pool_mutex == NULL)
     return ERROR;
 
+  mixer.kernels = pcm_simd_select();
+  mixer.resample_mode = PCM_RESAMPLE_LINEAR;
+  pcm_resample_init();
+  pcm_ring_init(&mixer.commands);
+  mixer.heap_size = 0;
+  mixer.max_voices = PCM_DEFAULT_VOICES;
+  mixer.frame = 0;
+  mixer.clock = 0;
+
+  memset(&positions, 0, sizeof(positions));
+  positions.near_dist = PCM_DEFAULT_NEAR;
+  positions.far_dist = PCM_DEFAULT_FAR;
+  mixer.near_dist = PCM_DEFAULT_NEAR;
+  mixer.far_dist = PCM_DEFAULT_FAR;
+  mixer.pan_dirty = 0;
+
+  _pcm_buses_init();
+
+  memset(mixer.accum, 0, sizeof(mixer.accum));
+  mixer.master = PCM_MASTER_LIMITER | PCM_MASTER_SOFTCLIP;
+  mixer.limiter_gain = 1.0f;
+
+  if (!pcm_stream_init())
+    return ERROR;
+
+  pcm_ring_init(&events.ring);
+  events.queued = 0;
+  events.busy = 0;
+  events.mode = PCM_DISPATCH_NONE;
+  events.thread = NULL;
+
+  events.ready = CreateEvent(NULL, FALSE, FALSE, NULL);
+  if (events.ready == NULL)
+    return ERROR;
+
+  memset(&telemetry, 0, sizeof(telemetry));
+  QueryPerformanceFrequency(&telemetry.freq);
+
+  memset(&workers, 0, sizeof(workers));
+  workers.threshold = PCM_DEFAULT_MIX_THRESHOLD;
+
+  latency.wanted = 0;
+  latency.interval = 0;
+  latency.resizes = 0;
+  latency.lost = 0;
+  latency.clean = 0;
+  latency.last_start = 0;
+  latency.thread = NULL;
+  latency.wake = NULL;
+
+  if (_pcm_mixer_open(backend) != NOERROR)
+    return ERROR;
+  InterlockedExchange(&mixer.initialized, 1);
+
+  if (latency.adaptive)
+    return _pcm_latency_start();
+
   return NOERROR;
 }
 
 void pcm_shutdown() {
+  struct pcm_player* tmp = NULL;
+
+  // No more callbacks once shutdown has started.
+  pcm_set_dispatch(PCM_DISPATCH_NONE);
+  pcm_set_mix_threads(0, 0);
+  _pcm_latency_stop();
+  InterlockedExchange(&mixer.initialized, 0);
+
   // repeatedly close the first player in the list until the list is empty.
-  struct pcm_player* tmp = players;
+  tmp = players;
   while (tmp != NULL) {
-    pcm_sound_close(tmp);
+    pcm_sound_close(tmp->handle);
     tmp = players;
   }
 
@@ -168,33 +679,96 @@ void pcm_shutdown() {
     tmp = pool;
   }
 
-  // At this point all handles are closed and the global list empty.
+  // At this point all handles are closed and the global list empty, so
+  // nothing is left for the callback to mix.
+  _pcm_mixer_close();
+  pcm_stream_shutdown();
+
   CloseHandle(players_mutex);
   CloseHandle(pool_mutex);
+  CloseHandle(events.ready);
 }
 
 
 DJ_HANDLE pcm_sound_open(unsigned char* buf, unsigned int len, pcm_notify_cb callback) {
+  return pcm_sound_open_ex(buf, len, callback, PCM_OPEN_COPY);
+}
+
+DJ_HANDLE pcm_sound_open_ex(unsigned char* buf, unsigned int len, pcm_notify_cb callback, unsigned int flags) {
+  struct pcm_player* p = NULL;
+  unsigned int bus = PCM_BUS_SFX;
+
+  if (buf == NULL) {
+    goto error1;
+  }
+
+  if ((flags >> 8) & 0xff) {
+    bus = ((flags >> 8) & 0xff) - 1;
+    if (bus >= PCM_BUSES)
+      goto error1;
+
+    flags |= buses[bus].storage;
+  }
+
+  p = _pcm_player_load(callback);
+  if (p == NULL) {
+    goto error1;
+  }
+
+  // Nothing can be mixing the player before it has a handle.
+  p->bus = p->mix_bus = bus;
+
+  p->sample = _pcm_sample_create(buf, len, flags);
+  if (p->sample == NULL) {
+    goto error2;
+  }
+
+  p->step = _pcm_mixer_step(p->sample->sample_rate);
+
+  p->handle = dj_handle_alloc(DJ_HANDLE_PCM, p);
+  if (p->handle == NULL) {
+    goto error2;
+  }
+
+  // Sound is loaded and ready. Add the player to our global list
+  // and return the "HANDLE" to the user.
+  _pcm_player_list_add(p);
+  return p->handle;
+
+error2:
+  _pcm_player_unload(p);
+  p = NULL;
+
+error1:
+  return NULL;
+}
+
+DJ_HANDLE pcm_sound_open_stream(const char* filename, pcm_notify_cb callback) {
   struct pcm_player* p = NULL;
 
+  if (filename == NULL) {
+    goto error1;
+  }
+
   p = _pcm_player_load(callback);
   if (p == NULL) {
     goto error1;
   }
 
-  p->sample = _pcm_sample_create(buf, len);
+  p->sample = _pcm_sample_stream(filename);
   if (p->sample == NULL) {
     goto error2;
   }
 
-  if (_pcm_stream_open(p) != NULL) {
-    // Score is loaded and ready. Add the player to our global list
-    // and return the "HANDLE" to the user.
-    return _pcm_player_list_add(p);
+  p->step = _pcm_mixer_step(p->sample->sample_rate);
+
+  p->handle = dj_handle_alloc(DJ_HANDLE_PCM, p);
+  if (p->handle == NULL) {
+    goto error2;
   }
 
-  _pcm_sample_free(p->sample);
-  p->sample = NULL;
+  _pcm_player_list_add(p);
+  return p->handle;
 
 error2:
   _pcm_player_unload(p);
@@ -205,160 +779,186 @@ error1:
 }
 
 void pcm_sound_close(DJ_HANDLE h) {
-  struct pcm_player* p = _pcm_player_list_remove(h);
+  unsigned int i;
+  // Once the handle is freed no other call can be using the player.
+  struct pcm_player* p = (struct pcm_player*)dj_handle_free(h, DJ_HANDLE_PCM);
   if (p == NULL) {
     return;
   }
 
-  // If it's still playing, stop it.
-  if (p->state != STATE_STOPPED) {
-    pcm_stop(p);
+  _pcm_player_list_remove(p);
+
+  // Keep the callback out while the player's voices are freed. Commands
+  // still queued for the player are applied first so none of them can reach
+  // it after it goes back to the pool. The voices hold the only pointers
+  // back to the player.
+  _pcm_mixer_lock();
+  _pcm_commands_apply();
+  for (i = 0; i < PCM_MAX_VOICES; i++) {
+    if (voices[i].claimed && voices[i].owner == p) {
+      _pcm_voice_free(&voices[i]);
+    }
   }
+  _pcm_mixer_unlock();
 
-  _pcm_stream_close(p);
   _pcm_player_unload(p);
 
   return;
 }
 
-DJ_RESULT pcm_play(DJ_HANDLE h) {
-  struct pcm_player* p = (struct pcm_player*)h;
-  unsigned int err = NOERROR;
+PCM_VOICE pcm_play_voice(DJ_HANDLE h) {
+  return pcm_play_voice_ex(h, PCM_PRIORITY_NORMAL);
+}
 
-  if (!_pcm_is_handle_valid(h)) {
-    return INVALID_PARAM;
+PCM_VOICE pcm_play_voice_ex(DJ_HANDLE h, unsigned int priority) {
+  PCM_VOICE id = PCM_INVALID_VOICE;
+
+  if (priority > PCM_PRIORITY_HIGH) {
+    return PCM_INVALID_VOICE;
   }
 
-  _pcm_lock(p);
-  if ((p->state == STATE_PLAYING) || (p->state == STATE_PAUSED) || (p->state == STATE_STOPPED)) {
-    _pcm_rewind(p);
-    p->state = STATE_PLAYING;
-    if (SDL_PlayAudioDevice(p->device) < 0) {
-      printf("pcm_play(): SDL_PlayAudioDevice %s\n", SDL_GetError());
-    }
+  _pcm_play(&h, 1, priority, 0, &id);
+
+  return id;
+}
+
+DJ_RESULT pcm_play_at(DJ_HANDLE h, unsigned long long frame) {
+  return _pcm_play(&h, 1, PCM_PRIORITY_NORMAL, frame, NULL);
+}
+
+DJ_RESULT pcm_play_group(const DJ_HANDLE* handles, unsigned int count, unsigned long long frame, PCM_VOICE* out) {
+  if (handles == NULL || count == 0) {
+    return INVALID_PARAM;
   }
-  _pcm_unlock(p);
 
-  return err;
+  return _pcm_play(handles, count, PCM_PRIORITY_NORMAL, frame, out);
+}
+
+unsigned long long pcm_mixer_frame() {
+  return (unsigned long long)InterlockedCompareExchange64(&mixer.clock, 0, 0);
+}
+
+DJ_RESULT pcm_play(DJ_HANDLE h) {
+  return _pcm_play(&h, 1, PCM_PRIORITY_NORMAL, 0, NULL);
 }
 
 DJ_RESULT pcm_pause(DJ_HANDLE h) {
-  struct pcm_player* p = (struct pcm_player*)h;
-  unsigned int err = NOERROR;
+  struct pcm_player* p = (struct pcm_player*)dj_handle_acquire(h, DJ_HANDLE_PCM);
+  DJ_RESULT err;
 
-  if(!_pcm_is_handle_valid(h)) {
+  if (p == NULL) {
     return INVALID_PARAM;
   }
 
-  _pcm_lock(p);
-  if (p->state == STATE_PLAYING) {
-    p->state = STATE_PAUSED;
-    if (SDL_PauseAudioDevice(p->device) < 0) {
-      printf("pcm_pause(): SDL_PauseAudioDevice %s\n", SDL_GetError());
-    }
-  }
-  _pcm_unlock(p);
+  err = _pcm_command_push(PCM_CMD_PAUSE, p, 0, 0, 0);
 
+  dj_handle_release(h);
   return err;
 }
 
 DJ_RESULT pcm_resume(DJ_HANDLE h) {
-  struct pcm_player* p = (struct pcm_player*)h;
-  unsigned int err = NOERROR;
+  struct pcm_player* p = (struct pcm_player*)dj_handle_acquire(h, DJ_HANDLE_PCM);
+  DJ_RESULT err;
 
-  if (!_pcm_is_handle_valid(h)) {
+  if (p == NULL) {
     return INVALID_PARAM;
   }
 
-  _pcm_lock(p);
-  if (p->state == STATE_PAUSED) {
-    p->state = STATE_PLAYING;
-    if (SDL_PlayAudioDevice(p->device) < 0) {
-      printf("pcm_resume(): SDL_PlayAudioDevice %s\n", SDL_GetError());
-    }
-  }
-  _pcm_unlock(p);
+  err = _pcm_command_push(PCM_CMD_RESUME, p, 0, 0, 0);
 
+  dj_handle_release(h);
   return err;
 }
 
 DJ_RESULT pcm_stop(DJ_HANDLE h) {
-  struct pcm_player* p = (struct pcm_player*)h;
+  struct pcm_player* p = (struct pcm_player*)dj_handle_acquire(h, DJ_HANDLE_PCM);
+  DJ_RESULT err;
 
-  if (!_pcm_is_handle_valid(h)) {
+  if (p == NULL) {
     return INVALID_PARAM;
   }
 
-  _pcm_lock(p);
-  p->state = STATE_STOPPED;
-  if (SDL_PauseAudioDevice(p->device) < 0) {
-    printf("pcm_stop(): SDL_PauseAudioDevice %s\n", SDL_GetError());
-  }
-  _pcm_rewind(p);
-  _pcm_unlock(p);
+  err = _pcm_command_push(PCM_CMD_STOP, p, 0, 0, 0);
 
-  return NOERROR;
+  dj_handle_release(h);
+  return err;
 }
 
 DJ_RESULT pcm_set_looping(DJ_HANDLE h, boolean looping) {
-  struct pcm_player* p = (struct pcm_player*)h;
+  struct pcm_player* p = (struct pcm_player*)dj_handle_acquire(h, DJ_HANDLE_PCM);
+  DJ_RESULT err;
 
-  if (!_pcm_is_handle_valid(h)) {
+  if (p == NULL) {
     return INVALID_PARAM;
   }
 
-  _pcm_lock(p);
   p->looping = looping;
-  _pcm_unlock(p);
+  err = _pcm_command_push(PCM_CMD_LOOPING, p, 0, looping, 0);
 
-  return NOERROR;
+  // The I/O thread needs to know whether to carry on from the start of the
+  // file when it gets to the end.
+  if (p->sample->stream != NULL)
+    InterlockedExchange(&p->sample->stream->looping, looping ? 1 : 0);
+
+  dj_handle_release(h);
+  return err;
 }
 
 DJ_RESULT pcm_set_volume_left(DJ_HANDLE h, unsigned int level) {
-  struct pcm_player* p = (struct pcm_player*)h;
+  struct pcm_player* p = (struct pcm_player*)dj_handle_acquire(h, DJ_HANDLE_PCM);
+  DJ_RESULT err;
 
-  if (!_pcm_is_handle_valid(h)) {
+  if (p == NULL) {
     return INVALID_PARAM;
   }
-  _pcm_lock(p);
+
   p->lvolume = level;
-  _pcm_unlock(p);
+  err = _pcm_command_push(PCM_CMD_VOLUME_LEFT, p, 0, level, 0);
 
-  return NOERROR;
+  dj_handle_release(h);
+  return err;
 }
-
 unsigned int pcm_get_volume_left(DJ_HANDLE h) {
-  struct pcm_player* p = (struct pcm_player*)h;
+  struct pcm_player* p = (struct pcm_player*)dj_handle_acquire(h, DJ_HANDLE_PCM);
+  unsigned int res;
 
-  if (!_pcm_is_handle_valid(h)) {
+  if (p == NULL) {
     return 0;
   }
 
-  return p->lvolume;
+  res = p->lvolume;
+
+  dj_handle_release(h);
+  return res;
 }
 
 DJ_RESULT pcm_set_volume_right(DJ_HANDLE h, unsigned int level) {
-  struct pcm_player* p = (struct pcm_player*)h;
+  struct pcm_player* p = (struct pcm_player*)dj_handle_acquire(h, DJ_HANDLE_PCM);
+  DJ_RESULT err;
 
-  if (!_pcm_is_handle_valid(h)) {
+  if (p == NULL) {
     return INVALID_PARAM;
   }
 
-  _pcm_lock(p);
   p->rvolume = level;
-  _pcm_unlock(p);
+  err = _pcm_command_push(PCM_CMD_VOLUME_RIGHT, p, 0, level, 0);
 
-  return NOERROR;
+  dj_handle_release(h);
+  return err;
 }
 
 unsigned int pcm_get_volume_right(DJ_HANDLE h) {
-  struct pcm_player* p = (struct pcm_player*)h;
+  struct pcm_player* p = (struct pcm_player*)dj_handle_acquire(h, DJ_HANDLE_PCM);
+  unsigned int res;
 
-  if (!_pcm_is_handle_valid(h)) {
+  if (p == NULL) {
     return 0;
   }
 
-  return p->rvolume;
+  res = p->rvolume;
+
+  dj_handle_release(h);
+  return res;
 }
 
 DJ_RESULT pcm_set_volume(DJ_HANDLE h, unsigned int level) {
@@ -373,160 +973,2021 @@ DJ_RESULT pcm_set_volume(DJ_HANDLE h, unsigned int level) {
 }
 
 boolean pcm_is_looping(DJ_HANDLE h) {
-  struct pcm_player* p = (struct pcm_player*)h;
-  if (!_pcm_is_handle_valid(h)) {
+  struct pcm_player* p = (struct pcm_player*)dj_handle_acquire(h, DJ_HANDLE_PCM);
+  boolean res;
+
+  if (p == NULL) {
     return false;
   }
 
-  return p->looping;
+  res = p->looping;
+
+  dj_handle_release(h);
+  return res;
 }
 
 boolean pcm_is_playing(DJ_HANDLE h) {
-  struct pcm_player* p = (struct pcm_player*)h;
-  if (!_pcm_is_handle_valid(h)) {
+  struct pcm_player* p = (struct pcm_player*)dj_handle_acquire(h, DJ_HANDLE_PCM);
+  unsigned int states;
+
+  if (p == NULL) {
     return false;
   }
 
-  return (p->state == STATE_PLAYING);
+  states = _pcm_player_voice_states(p);
+
+  dj_handle_release(h);
+  return (states & (1 << STATE_PLAYING)) != 0;
 }
 
 boolean pcm_is_paused(DJ_HANDLE h) {
-  struct pcm_player* p = (struct pcm_player*)h;
-  if (!_pcm_is_handle_valid(h)) {
+  struct pcm_player* p = (struct pcm_player*)dj_handle_acquire(h, DJ_HANDLE_PCM);
+  unsigned int states;
+
+  if (p == NULL) {
     return false;
   }
 
-  return (p->state == STATE_PAUSED);
+  states = _pcm_player_voice_states(p);
+
+  dj_handle_release(h);
+  return (states & (1 << STATE_PAUSED)) && !(states & (1 << STATE_PLAYING));
 }
 
 boolean pcm_is_stopped(DJ_HANDLE h) {
-  struct pcm_player* p = (struct pcm_player*)h;
-  if (!_pcm_is_handle_valid(h)) {
+  struct pcm_player* p = (struct pcm_player*)dj_handle_acquire(h, DJ_HANDLE_PCM);
+  unsigned int states;
+
+  if (p == NULL) {
     return false;
   }
 
-  return (p->state == STATE_STOPPED);
+  states = _pcm_player_voice_states(p);
+
+  dj_handle_release(h);
+  return states == 0;
 }
 
-static void _pcm_audio_callback(void* userdata, Uint8* stream, int len) {
-  struct pcm_player* p = (struct pcm_player*)userdata;
-  struct pcm_sample* s = p->sample;
+DJ_RESULT pcm_voice_stop(PCM_VOICE voice) {
+  if (_pcm_voice_lookup(voice) == NULL) {
+    return INVALID_PARAM;
+  }
 
-  unsigned int bytesread = s->ptr - s->raw_bytes;
-  unsigned int bytesleft = s->raw_len - bytesread;
+  return _pcm_command_push(PCM_CMD_VOICE_STOP, NULL, voice, 0, 0);
+}
 
-  if (bytesleft == 0) {
-    _pcm_rewind(p);
+DJ_RESULT pcm_voice_set_volume(PCM_VOICE voice, unsigned int left, unsigned int right) {
+  if (_pcm_voice_lookup(voice) == NULL) {
+    return INVALID_PARAM;
+  }
 
-    if(p->looping) {
-      bytesread = s->ptr - s->raw_bytes;
-      bytesleft = s->raw_len - bytesread;
-    } else {
-      memset(stream, p->sample->silence, len);
-      p->state = STATE_STOPPED;
-      SDL_PauseAudioDevice(p->device);
-      if (p->cb) {
-        p->cb(p);
-      }
+  return _pcm_command_push(PCM_CMD_VOICE_VOLUME, NULL, voice, left, right);
+}
 
-      return;
-    }
+DJ_RESULT pcm_voice_set_pitch(PCM_VOICE voice, unsigned int rate) {
+  if (rate < PCM_PITCH_MIN || rate > PCM_PITCH_MAX) {
+    return INVALID_PARAM;
   }
 
-  if (bytesleft >= (unsigned int)len) {
-    bytesread = len;
-  } else {
-    bytesread = bytesleft;
-    memset(stream + bytesread, p->sample->silence, len - bytesread);
+  if (_pcm_voice_lookup(voice) == NULL) {
+    return INVALID_PARAM;
   }
 
-  memcpy(stream, s->ptr, bytesread);
-  _pcm_adjust_volume(stream, bytesread, p);
+  return _pcm_command_push(PCM_CMD_VOICE_PITCH, NULL, voice, rate, 0);
+}
+
+DJ_RESULT pcm_mix_render(float* out, unsigned int frames) {
+  if (mixer.backend != PCM_BACKEND_NULL || out == NULL) {
+    return ERROR;
+  }
 
-  s->ptr += bytesread;
+  _pcm_mixer_lock();
+  _pcm_render(&mixer, out, frames, true);
+  _pcm_mixer_unlock();
 
+  return NOERROR;
 }
 
-static DJ_RESULT _pcm_lock(DJ_HANDLE h) {
-  struct pcm_player* p = (struct pcm_player*)h;
+DJ_RESULT pcm_set_resample_mode(unsigned int mode) {
+  if (mode != PCM_RESAMPLE_LINEAR && mode != PCM_RESAMPLE_SINC) {
+    return INVALID_PARAM;
+  }
 
-  WaitForSingleObject(p->mutex, INFINITE);
+  // Picked up by the callback on its next block.
+  mixer.resample_mode = mode;
 
   return NOERROR;
 }
 
-static DJ_RESULT _pcm_unlock(DJ_HANDLE h) {
-  struct pcm_player* p = (struct pcm_player*)h;
+boolean pcm_voice_is_playing(PCM_VOICE voice) {
+  return _pcm_voice_lookup(voice) != NULL;
+}
+
+DJ_RESULT pcm_voice_set_position(PCM_VOICE voice, float x, float y) {
+  return pcm_voice_set_positions(&voice, &x, &y, 1);
+}
+
+DJ_RESULT pcm_voice_set_positions(const PCM_VOICE* ids, const float* x, const float* y, unsigned int count) {
+  unsigned int i, slot;
 
-  if(ReleaseMutex(p->mutex)) {
-    return NOERROR;
+  if (ids == NULL || x == NULL || y == NULL) {
+    return INVALID_PARAM;
   }
-  return ERROR;
-}
 
-static DJ_RESULT _pcm_rewind(DJ_HANDLE h) {
-  struct pcm_player* p = (struct pcm_player*)h;
+  _pcm_positions_lock();
+  for (i = 0; i < count; i++) {
+    slot = PCM_VOICE_SLOT(ids[i]);
+    if (ids[i] == PCM_INVALID_VOICE || slot >= PCM_MAX_VOICES)
+      continue;
 
-  if (p->sample != NULL)
-    p->sample->ptr = p->sample->raw_bytes;
+    // The callback checks the id is still the slot's voice before using it.
+    positions.id[slot] = ids[i];
+    positions.x[slot] = x[i];
+    positions.y[slot] = y[i];
+  }
+  positions.dirty = 1;
+  _pcm_positions_unlock();
 
   return NOERROR;
 }
 
-static struct pcm_player* _pcm_player_pool_remove() {
-  struct pcm_player* p = NULL;
-  WaitForSingleObject(pool_mutex, INFINITE);
-  if (pool != NULL) { // if a player is available in the pool, grab that
-    p = pool;
-    pool = pool->next;
-    ReleaseMutex(pool_mutex);
+DJ_RESULT pcm_voice_set_filter(PCM_VOICE voice, unsigned int type, unsigned int cutoff) {
+  return pcm_voice_set_filters(&voice, &type, &cutoff, 1);
+}
 
-    p->state = STATE_STOPPED;
-    p->looping = 0;
-    p->lvolume = 65536;
-    p->rvolume = 65536;
-    p->sample = NULL;
-    p->next = NULL;
-    p->cb = NULL;
+DJ_RESULT pcm_voice_set_filters(const PCM_VOICE* ids, const unsigned int* types, const unsigned int* cutoffs, unsigned int count) {
+  unsigned int i, slot;
+
+  if (ids == NULL || types == NULL || cutoffs == NULL) {
+    return INVALID_PARAM;
   }
 
-  ReleaseMutex(pool_mutex);
-  return p;
-}
+  for (i = 0; i < count; i++) {
+    if (types[i] > PCM_FILTER_HIGHPASS) {
+      return INVALID_PARAM;
+    }
+  }
 
-static struct pcm_player* _pcm_player_load(pcm_notify_cb callback) {
-  struct pcm_player* p = NULL;
-  
-  p = _pcm_player_pool_remove();
-  if(p == NULL) { // otherwise, create a new one
+  _pcm_positions_lock();
+  for (i = 0; i < count; i++) {
+    slot = PCM_VOICE_SLOT(ids[i]);
+    if (ids[i] == PCM_INVALID_VOICE || slot >= PCM_MAX_VOICES)
+      continue;
 
-    p = (struct pcm_player*)malloc(sizeof(struct pcm_player));
-    if (p != NULL) {
-      p->state = STATE_STOPPED;
-      p->looping = 0;
-      p->lvolume = 65536;
-      p->rvolume = 65536;
+    positions.filter_id[slot] = ids[i];
+    positions.filter[slot] = types[i];
+    positions.cutoff[slot] = cutoffs[i];
+  }
+  positions.dirty = 1;
+  _pcm_positions_unlock();
+
+  return NOERROR;
+}
+
+DJ_RESULT pcm_set_distance_model(float near_dist, float far_dist) {
+  if (!(near_dist >= 0.0f) || !(far_dist > near_dist)) {
+    return INVALID_PARAM;
+  }
+
+  _pcm_positions_lock();
+  positions.near_dist = near_dist;
+  positions.far_dist = far_dist;
+  positions.dirty = 1;
+  _pcm_positions_unlock();
+
+  return NOERROR;
+}
+
+boolean pcm_voice_is_virtual(PCM_VOICE voice) {
+  struct pcm_voice* v = _pcm_voice_lookup(voice);
+
+  return v != NULL && v->virt;
+}
+
+unsigned int pcm_poll_events(struct pcm_event* out, unsigned int max) {
+  struct pcm_command evt;
+  unsigned int n = 0;
+
+  if (out == NULL || max == 0) {
+    return 0;
+  }
+
+  // The ring has a single consumer. A second caller just comes back empty.
+  if (InterlockedCompareExchange(&events.busy, 1, 0) != 0) {
+    return 0;
+  }
+
+  while (n < max && pcm_ring_pop(&events.ring, &evt)) {
+    out[n].type = evt.type;
+    out[n].handle = evt.target;
+    out[n].voice = evt.voice;
+    out[n].frame = evt.a | ((unsigned long long)evt.b << 32);
+    n++;
+  }
+
+  InterlockedExchange(&events.busy, 0);
+
+  return n;
+}
+
+unsigned int pcm_dispatch_events() {
+  struct pcm_event evt;
+  unsigned int n = 0;
+
+  while (pcm_poll_events(&evt, 1) == 1) {
+    _pcm_event_notify(&evt);
+    n++;
+  }
+
+  return n;
+}
+
+DJ_HANDLE pcm_event_handle() {
+  return events.ready;
+}
+
+DJ_RESULT pcm_set_max_voices(unsigned int count) {
+  if (count == 0 || count > PCM_MAX_VOICES) {
+    return INVALID_PARAM;
+  }
+
+  return _pcm_command_push(PCM_CMD_MAX_VOICES, NULL, 0, count, 0);
+}
+
+DJ_RESULT pcm_set_bus(DJ_HANDLE h, unsigned int bus) {
+  struct pcm_player* p;
+  DJ_RESULT err;
+
+  if (bus >= PCM_BUSES) {
+    return INVALID_PARAM;
+  }
+
+  p = (struct pcm_player*)dj_handle_acquire(h, DJ_HANDLE_PCM);
+  if (p == NULL) {
+    return INVALID_PARAM;
+  }
+
+  p->bus = bus;
+  err = _pcm_command_push(PCM_CMD_BUS, p, 0, bus, 0);
+
+  dj_handle_release(h);
+  return err;
+}
+
+unsigned int pcm_get_bus(DJ_HANDLE h) {
+  struct pcm_player* p = (struct pcm_player*)dj_handle_acquire(h, DJ_HANDLE_PCM);
+  unsigned int res;
+
+  if (p == NULL) {
+    return PCM_BUS_SFX;
+  }
+
+  res = p->bus;
+
+  dj_handle_release(h);
+  return res;
+}
+
+DJ_RESULT pcm_bus_set_volume(unsigned int bus, unsigned int level) {
+  if (bus >= PCM_BUSES) {
+    return INVALID_PARAM;
+  }
+
+  return _pcm_command_push(PCM_CMD_BUS_VOLUME, NULL, 0, bus, level);
+}
+
+DJ_RESULT pcm_bus_set_mute(unsigned int bus, boolean mute) {
+  if (bus >= PCM_BUSES) {
+    return INVALID_PARAM;
+  }
+
+  return _pcm_command_push(PCM_CMD_BUS_MUTE, NULL, 0, bus, mute ? 1 : 0);
+}
+
+DJ_RESULT pcm_bus_set_storage(unsigned int bus, unsigned int flags) {
+  if (bus >= PCM_BUSES || (flags & ~(PCM_OPEN_NATIVE | PCM_OPEN_ADPCM)) != 0) {
+    return INVALID_PARAM;
+  }
+
+  // Only read by pcm_sound_open_ex(), the mixer never looks at it.
+  buses[bus].storage = flags;
+
+  return NOERROR;
+}
+
+DJ_RESULT pcm_bus_set_ducking(unsigned int bus, unsigned int sidechain, unsigned int depth, unsigned int attack_ms, unsigned int release_ms) {
+  struct pcm_bus* b;
+
+  if (bus >= PCM_BUSES || sidechain == bus || depth > 65536) {
+    return INVALID_PARAM;
+  }
+
+  if (sidechain >= PCM_BUSES && sidechain != PCM_BUS_NONE) {
+    return INVALID_PARAM;
+  }
+
+  b = &buses[bus];
+  b->sidechain = sidechain;
+  b->depth = depth;
+  b->attack_ms = attack_ms;
+  b->release_ms = release_ms;
+
+  return _pcm_command_push(PCM_CMD_BUS_DUCKING, NULL, 0, bus, 0);
+}
+
+DJ_RESULT pcm_set_latency(unsigned int frames) {
+  // Powers of two suit every audio driver's period.
+  if (frames != PCM_LATENCY_ADAPTIVE && (frames < PCM_PERIOD_MIN || frames > PCM_PERIOD_MAX || (frames & (frames - 1)) != 0)) {
+    return INVALID_PARAM;
+  }
+
+  // Before pcm_init() this only picks the period to open with.
+  if (!mixer.initialized) {
+    latency.adaptive = frames == PCM_LATENCY_ADAPTIVE;
+    if (!latency.adaptive) {
+      latency.requested = frames;
+    }
+    return NOERROR;
+  }
+
+  // The thread has to be there before the callback can ask it for anything.
+  if (frames == PCM_LATENCY_ADAPTIVE) {
+    if (_pcm_latency_start() != NOERROR) {
+      return ERROR;
+    }
+    latency.adaptive = 1;
+    return NOERROR;
+  }
+
+  latency.adaptive = 0;
+  latency.requested = frames;
+
+  return _pcm_mixer_reopen(frames, false);
+}
+
+DJ_RESULT pcm_get_latency(struct pcm_latency_info* info) {
+  if (info == NULL) {
+    return INVALID_PARAM;
+  }
+
+  info->adaptive = latency.adaptive;
+  info->period = latency.period;
+  info->period_us = (unsigned int)latency.interval;
+  info->latency_us = 0;
+  info->resizes = (unsigned int)latency.resizes;
+  info->lost = (unsigned int)latency.lost;
+
+  // One period queued in the device and one being rendered, plus whatever
+  // the limiter holds back.
+  if (mixer.rate != 0) {
+    unsigned int frames = latency.period * 2;
+    if (mixer.master & PCM_MASTER_LIMITER)
+      frames += PCM_LIMITER_LOOKAHEAD;
+    info->latency_us = (unsigned int)((unsigned long long)frames * 1000000 / mixer.rate);
+  }
+
+  return NOERROR;
+}
+
+DJ_RESULT pcm_set_mix_threads(unsigned int threads, unsigned int threshold) {
+  unsigned int i;
+
+  if (threads > PCM_MAX_MIX_THREADS) {
+    return INVALID_PARAM;
+  }
+
+  // The callback only looks at the helpers while it holds the mixer, so
+  // they can be replaced with it locked out.
+  _pcm_mixer_lock();
+
+  _pcm_workers_stop();
+  workers.threshold = threshold > 0 ? threshold : PCM_DEFAULT_MIX_THRESHOLD;
+
+  for (i = 0; i < threads; i++) {
+    void* block = malloc(sizeof(struct pcm_mix_ctx) + PCM_CACHE_LINE);
+    if (block == NULL)
+      goto error1;
+
+    workers.ctx[i] = (struct pcm_mix_ctx*)(((UINT_PTR)block + PCM_CACHE_LINE) & ~(UINT_PTR)(PCM_CACHE_LINE - 1));
+    workers.ctx[i]->block = block;
+    workers.ctx[i]->lanes = 0;
+
+    workers.start[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
+    workers.done[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (workers.start[i] == NULL || workers.done[i] == NULL)
+      goto error1;
+
+    workers.thread[i] = CreateThread(NULL, 0, _pcm_worker_proc, (LPVOID)(UINT_PTR)i, 0, NULL);
+    if (workers.thread[i] == NULL)
+      goto error1;
+
+    workers.count = i + 1;
+  }
+
+  _pcm_mixer_unlock();
+  return NOERROR;
+
+error1:
+  // Everything set up so far is torn down by the same path as a stop.
+  workers.count = i + 1;
+  _pcm_workers_stop();
+  _pcm_mixer_unlock();
+  return ERROR;
+}
+
+DJ_RESULT pcm_set_master(unsigned int flags) {
+  if (flags & ~(PCM_MASTER_LIMITER | PCM_MASTER_SOFTCLIP)) {
+    return INVALID_PARAM;
+  }
+
+  return _pcm_command_push(PCM_CMD_MASTER, NULL, 0, flags, 0);
+}
+
+DJ_RESULT pcm_render_wav(const char* filename, unsigned int frames) {
+  short out[MAX_BUFFER_SIZE * PCM_MIXER_CHANNELS];
+  unsigned char header[44];
+  unsigned long long bytes;
+  unsigned int n;
+  FILE* f = NULL;
+
+  if (mixer.backend != PCM_BACKEND_NULL) {
+    return ERROR;
+  }
+
+  // 16 bit PCM, the size of the data is known up front. The RIFF size
+  // fields are 32 bits.
+  bytes = (unsigned long long)frames * mixer.channels * sizeof(short);
+
+  if (filename != NULL) {
+    if (36 + bytes > 0xffffffff) {
+      return INVALID_PARAM;
+    }
+
+    f = fopen(filename, "wb");
+    if (f == NULL) {
+      return ERROR;
+    }
+
+    memcpy(header, "RIFF", 4);
+    _pcm_put_le32(header + 4, (unsigned int)(36 + bytes));
+    memcpy(header + 8, "WAVEfmt ", 8);
+    _pcm_put_le32(header + 16, 16);
+    _pcm_put_le16(header + 20, 1);
+    _pcm_put_le16(header + 22, mixer.channels);
+    _pcm_put_le32(header + 24, mixer.rate);
+    _pcm_put_le32(header + 28, mixer.rate * mixer.channels * sizeof(short));
+    _pcm_put_le16(header + 32, mixer.channels * sizeof(short));
+    _pcm_put_le16(header + 34, 16);
+    memcpy(header + 36, "data", 4);
+    _pcm_put_le32(header + 40, (unsigned int)bytes);
+
+    if (fwrite(header, 1, sizeof(header), f) != sizeof(header)) {
+      goto error1;
+    }
+  }
+
+  while (frames > 0) {
+    n = frames < MAX_BUFFER_SIZE ? frames : MAX_BUFFER_SIZE;
+
+    _pcm_mixer_lock();
+    _pcm_audio_callback(&mixer, (Uint8*)out, n * mixer.channels * sizeof(short));
+    _pcm_mixer_unlock();
+
+    if (f != NULL && fwrite(out, sizeof(short), n * mixer.channels, f) != n * mixer.channels) {
+      goto error1;
+    }
+
+    frames -= n;
+  }
+
+  if (f != NULL) {
+    fclose(f);
+  }
+
+  return NOERROR;
+
+error1:
+  fclose(f);
+  return ERROR;
+}
+
+DJ_RESULT pcm_enable_stats(boolean enable) {
+  if (enable == true) {
+    InterlockedExchange(&telemetry.reset, 1);
+  }
+
+  InterlockedExchange(&telemetry.enabled, enable == true ? 1 : 0);
+
+  return NOERROR;
+}
+
+void pcm_reset_stats() {
+  InterlockedExchange(&telemetry.reset, 1);
+}
+
+DJ_RESULT pcm_get_stats(struct pcm_stats* stats) {
+  LONG seq;
+
+  if (stats == NULL) {
+    return INVALID_PARAM;
+  }
+
+  do {
+    seq = telemetry.seq;
+    MemoryBarrier();
+    memcpy(stats, &telemetry.stats, sizeof(*stats));
+    MemoryBarrier();
+  } while ((seq & 1) || seq != telemetry.seq);
+
+  return NOERROR;
+}
+
+DJ_RESULT pcm_set_dispatch(unsigned int mode) {
+  if (mode == PCM_DISPATCH_THREAD && events.thread == NULL) {
+    events.quit = 0;
+    events.thread = CreateThread(NULL, 0, _pcm_dispatch_proc, NULL, 0, NULL);
+    if (events.thread == NULL) {
+      return ERROR;
+    }
+  } else if (mode == PCM_DISPATCH_NONE && events.thread != NULL) {
+    InterlockedExchange(&events.quit, 1);
+    SetEvent(events.ready);
+    WaitForSingleObject(events.thread, INFINITE);
+    CloseHandle(events.thread);
+    events.thread = NULL;
+  } else if (mode != PCM_DISPATCH_NONE && mode != PCM_DISPATCH_THREAD) {
+    return INVALID_PARAM;
+  }
+
+  events.mode = mode;
+
+  return NOERROR;
+}
+
+/*
+ * Claims a voice for each handle and queues them to start together. The
+ * voices are chained off the first one and queued as one command, so the
+ * callback starts all of them in the same block. Either every voice is
+ * queued or none is.
+ */
+static DJ_RESULT _pcm_play(const DJ_HANDLE* handles, unsigned int count, unsigned int priority, unsigned long long start, PCM_VOICE* out) {
+  struct pcm_voice* head = NULL;
+  struct pcm_voice* tail = NULL;
+  struct pcm_voice* v = NULL;
+  unsigned int acquired = 0;
+  DJ_RESULT err = NOERROR;
+  unsigned int i;
+
+  for (i = 0; i < count; i++) {
+    struct pcm_player* p = (struct pcm_player*)dj_handle_acquire(handles[i], DJ_HANDLE_PCM);
+    if (p == NULL) {
+      err = INVALID_PARAM;
+      goto error1;
+    }
+    acquired++;
+
+    v = _pcm_voice_alloc(p, priority);
+    if (v == NULL) {
+      err = ERROR;
+      goto error1;
+    }
+
+    v->start = start;
+    if (tail != NULL)
+      tail->group = v;
+    else
+      head = v;
+    tail = v;
+
+    // Once the command is queued the voices belong to the audio thread, so
+    // the ids are copied out first.
+    if (out != NULL)
+      out[i] = v->id;
+  }
+
+  // The voices have not been seen by the audio thread yet so they are still
+  // ours to free if the command can not be queued.
+  if (_pcm_command_push(PCM_CMD_VOICE_PLAY, NULL, head->id, 0, 0) != NOERROR) {
+    err = ERROR;
+    goto error1;
+  }
+
+  for (i = 0; i < acquired; i++)
+    dj_handle_release(handles[i]);
+
+  return NOERROR;
+
+error1:
+  while (head != NULL) {
+    v = head->group;
+    _pcm_voice_free(head);
+    head = v;
+  }
+
+  if (out != NULL) {
+    for (i = 0; i < count; i++)
+      out[i] = PCM_INVALID_VOICE;
+  }
+
+  for (i = 0; i < acquired; i++)
+    dj_handle_release(handles[i]);
+
+  return err;
+}
+
+static void _pcm_audio_callback(void* userdata, Uint8* stream, int len) {
+  struct pcm_mixer* m = (struct pcm_mixer*)userdata;
+  unsigned int frames = len / (m->channels * sizeof(short));
+
+  _pcm_render(m, stream, frames, false);
+
+  if (frames * m->channels * sizeof(short) < (unsigned int)len) {
+    memset(stream + frames * m->channels * sizeof(short), 0, len - frames * m->channels * sizeof(short));
+  }
+}
+
+/*
+ * Mixes frames of output into out, s16 or float, a block at a time. Called
+ * by the device callback, or with the mixer locked by pcm_render_wav() and
+ * pcm_mix_render().
+ */
+static void _pcm_render(struct pcm_mixer* m, void* out, unsigned int frames, boolean f32) {
+  LARGE_INTEGER start;
+  unsigned int mixed = 0;
+  unsigned int done = 0;
+  // Read once, the API can turn stats on or off while the block mixes.
+  boolean stats = telemetry.enabled != 0;
+  boolean timed = stats || latency.adaptive;
+
+  if (timed) {
+    QueryPerformanceCounter(&start);
+  }
+
+  // Periods longer than the mix block are mixed a block at a time.
+  while (done < frames) {
+    unsigned int n = frames - done;
+    unsigned int voices_mixed;
+
+    if (n > MAX_BUFFER_SIZE)
+      n = MAX_BUFFER_SIZE;
+
+    if (f32)
+      voices_mixed = _pcm_mix_block(m, (float*)out + done * m->channels, n, true);
+    else
+      voices_mixed = _pcm_mix_block(m, (short*)out + done * m->channels, n, false);
+    if (voices_mixed > mixed)
+      mixed = voices_mixed;
+    done += n;
+  }
+
+  // One wakeup per period however many voices finished in it.
+  if (events.queued) {
+    events.queued = 0;
+    SetEvent(events.ready);
+  }
+
+  if (stats) {
+    _pcm_telemetry_update(start.QuadPart, frames, mixed);
+  }
+
+  if (timed) {
+    _pcm_latency_update(start.QuadPart, frames);
+  }
+}
+
+/*
+ * Mixes one block of at most MAX_BUFFER_SIZE frames into out. Returns the
+ * number of voices mixed.
+ */
+static unsigned int _pcm_mix_block(struct pcm_mixer* m, void* out, unsigned int frames, boolean f32) {
+  unsigned int mixed = 0;
+  unsigned int audible = 0;
+  unsigned int i;
+  int* mix;
+  int* master;
+
+  // Everything the API asked for since the last block takes effect here.
+  _pcm_commands_apply();
+  _pcm_positions_apply();
+  _pcm_buses_update(frames);
+
+  mix = m->accum + PCM_LIMITER_LOOKAHEAD * m->channels;
+  memset(mix, 0, frames * m->channels * sizeof(int));
+
+  // Virtual voices cost next to nothing, so last block's audible count
+  // decides whether splitting the block is worth waking the helpers.
+  workers.frames = frames;
+  workers.voices = 0;
+  for (i = 0; i < PCM_MAX_VOICES; i++) {
+    if (voices[i].state == STATE_PLAYING) {
+      workers.list[workers.voices++] = i;
+      if (!voices[i].virt)
+        audible++;
+    }
+  }
+
+  if (workers.count > 0 && audible >= workers.threshold) {
+    unsigned int shares = workers.count + 1;
+
+    for (i = 0; i <= shares; i++)
+      workers.first[i] = workers.voices * i / shares;
+
+    for (i = 0; i < workers.count; i++)
+      SetEvent(workers.start[i]);
+
+    _pcm_mix_share(&main_ctx, mix, 0);
+
+    for (i = 0; i < workers.count; i++) {
+      struct pcm_mix_ctx* ctx = workers.ctx[i];
+      unsigned int b;
+
+      WaitForSingleObject(workers.done[i], INFINITE);
+      m->kernels->add_s32(mix, ctx->accum, frames * m->channels);
+      main_ctx.mixed += ctx->mixed;
+      for (b = 0; b < PCM_BUSES; b++)
+        main_ctx.active[b] += ctx->active[b];
+    }
+  } else {
+    workers.first[0] = 0;
+    workers.first[1] = workers.voices;
+    _pcm_mix_share(&main_ctx, mix, 0);
+  }
+
+  mixed = main_ctx.mixed;
+  for (i = 0; i < PCM_BUSES; i++)
+    buses[i].active += main_ctx.active[i];
+
+  // Voices that ran out are freed here, in slot order, so their events come
+  // out the same however the block was split.
+  for (i = 0; i < workers.voices; i++) {
+    struct pcm_voice* v = &voices[workers.list[i]];
+    if (v->ended) {
+      v->ended = 0;
+      _pcm_voice_end_of_sample(v);
+    }
+  }
+
+  master = _pcm_master(mix, frames);
+  if (f32)
+    m->kernels->clip_f32((float*)out, master, frames * m->channels);
+  else
+    m->kernels->clip_s16((short*)out, master, frames * m->channels);
+
+  // The frames the limiter held back lead the next block.
+  if (m->master & PCM_MASTER_LIMITER)
+    memmove(m->accum, m->accum + frames * m->channels, PCM_LIMITER_LOOKAHEAD * m->channels * sizeof(int));
+
+  m->frame += frames;
+  InterlockedExchange64(&m->clock, (LONGLONG)m->frame);
+
+  return mixed;
+}
+
+/*
+ * Mixes one share of the block's voice list into accum, which is cleared
+ * first unless it is the main mix. Runs on the audio thread for share 0
+ * and on helper k - 1 for share k. Only the voices in the share and the
+ * context are written.
+ */
+static void _pcm_mix_share(struct pcm_mix_ctx* ctx, int* accum, unsigned int share) {
+  unsigned int i;
+
+  ctx->mixed = 0;
+  memset(ctx->active, 0, sizeof(ctx->active));
+  if (share > 0)
+    memset(accum, 0, workers.frames * mixer.channels * sizeof(int));
+
+  for (i = workers.first[share]; i < workers.first[share + 1]; i++) {
+    struct pcm_voice* v = &voices[workers.list[i]];
+
+    if (v->filter != PCM_FILTER_NONE)
+      ctx->mixed += _pcm_voice_filter(v, ctx, accum, workers.frames);
+    else
+      ctx->mixed += _pcm_voice_render(v, ctx, accum, workers.frames);
+  }
+
+  if (ctx->lanes > 0)
+    _pcm_filter_bank_run(ctx, accum, workers.frames);
+}
+
+static DWORD WINAPI _pcm_worker_proc(LPVOID param) {
+  unsigned int k = (unsigned int)(UINT_PTR)param;
+  struct pcm_mix_ctx* ctx = workers.ctx[k];
+
+  while (WaitForSingleObject(workers.start[k], INFINITE) == WAIT_OBJECT_0) {
+    if (workers.quit) {
+      break;
+    }
+
+    _pcm_mix_share(ctx, ctx->accum, k + 1);
+    SetEvent(workers.done[k]);
+  }
+
+  return 0;
+}
+
+/*
+ * Stops and frees every helper thread. Called with the mixer locked.
+ */
+static void _pcm_workers_stop() {
+  unsigned int i;
+
+  InterlockedExchange(&workers.quit, 1);
+
+  for (i = 0; i < workers.count; i++) {
+    if (workers.thread[i] != NULL) {
+      SetEvent(workers.start[i]);
+      WaitForSingleObject(workers.thread[i], INFINITE);
+      CloseHandle(workers.thread[i]);
+    }
+    if (workers.start[i] != NULL)
+      CloseHandle(workers.start[i]);
+    if (workers.done[i] != NULL)
+      CloseHandle(workers.done[i]);
+    if (workers.ctx[i] != NULL)
+      free(workers.ctx[i]->block);
+
+    workers.thread[i] = NULL;
+    workers.start[i] = NULL;
+    workers.done[i] = NULL;
+    workers.ctx[i] = NULL;
+  }
+
+  workers.count = 0;
+  InterlockedExchange(&workers.quit, 0);
+}
+
+/*
+ * Adaptive latency. A callback that runs over its budget or comes so late
+ * that the device must have run dry doubles the period at once. Only after
+ * PCM_ADAPT_SECONDS of callbacks using under half their budget is the
+ * period halved again, so a machine near its limit does not flap between
+ * two sizes. Audio thread only.
+ */
+static void _pcm_latency_update(LONGLONG start, unsigned int frames) {
+  LONGLONG budget = (LONGLONG)frames * telemetry.freq.QuadPart / mixer.rate;
+  LARGE_INTEGER end;
+  LONGLONG used;
+  boolean late = false;
+
+  QueryPerformanceCounter(&end);
+  used = end.QuadPart - start;
+
+  if (latency.last_start != 0) {
+    LONGLONG interval = start - latency.last_start;
+    late = interval > 2 * budget;
+    InterlockedExchange(&latency.interval, (LONG)(interval * 1000000 / telemetry.freq.QuadPart));
+  }
+  latency.last_start = start;
+
+  // Only a device has a period to change.
+  if (!latency.adaptive || latency.wanted != 0 || latency.thread == NULL)
+    return;
+
+  if (used > budget || late) {
+    latency.clean = 0;
+    if (latency.period < PCM_PERIOD_MAX) {
+      InterlockedExchange(&latency.wanted, (LONG)(latency.period * 2));
+      SetEvent(latency.wake);
+    }
+  } else if (used < budget / 2) {
+    latency.clean += frames;
+    if (latency.clean >= mixer.rate * PCM_ADAPT_SECONDS && latency.period > PCM_PERIOD_MIN) {
+      latency.clean = 0;
+      InterlockedExchange(&latency.wanted, (LONG)(latency.period / 2));
+      SetEvent(latency.wake);
+    }
+  } else {
+    latency.clean = 0;
+  }
+}
+
+/*
+ * Runs the master stages over a mixed block and returns the frames to
+ * output. With the limiter on these start PCM_LIMITER_LOOKAHEAD frames
+ * before mix, in the frames held back from the previous block.
+ */
+static int* _pcm_master(int* mix, unsigned int frames) {
+  int* out = mix;
+
+  if (mixer.master & PCM_MASTER_LIMITER) {
+    out = mixer.accum;
+    _pcm_limiter(out, frames);
+  }
+
+  if (mixer.master & PCM_MASTER_SOFTCLIP)
+    mixer.kernels->softclip_s32(out, frames * mixer.channels, PCM_SOFTCLIP_KNEE, PCM_SOFTCLIP_CEILING);
+
+  return out;
+}
+
+/*
+ * Look-ahead peak limiter over the held back frames and the new block in
+ * buf. Each segment of PCM_LIMITER_LOOKAHEAD output frames is ramped to a
+ * gain that holds both it and the segment after it under the ceiling, so no
+ * peak gets through and the gain never jumps. Reduction takes effect within
+ * a segment, recovery is limited to the release rate. The cost per block is
+ * one peak scan and one ramp over the block.
+ */
+static void _pcm_limiter(int* buf, unsigned int frames) {
+  int peaks[MAX_BUFFER_SIZE / PCM_LIMITER_LOOKAHEAD + 2];
+  unsigned int channels = mixer.channels;
+  unsigned int total = PCM_LIMITER_LOOKAHEAD + frames;
+  unsigned int segments = (total + PCM_LIMITER_LOOKAHEAD - 1) / PCM_LIMITER_LOOKAHEAD;
+  float ceiling = (float)((mixer.master & PCM_MASTER_SOFTCLIP) ? PCM_LIMITER_CEILING : PCM_SOFTCLIP_CEILING);
+  float release = 1000.0f / ((float)PCM_LIMITER_RELEASE * (float)mixer.rate);
+  float gain = mixer.limiter_gain;
+  unsigned int k, first;
+
+  for (k = 0; k < segments; k++) {
+    unsigned int n = total - k * PCM_LIMITER_LOOKAHEAD;
+    if (n > PCM_LIMITER_LOOKAHEAD)
+      n = PCM_LIMITER_LOOKAHEAD;
+    peaks[k] = mixer.kernels->peak_s32(buf + k * PCM_LIMITER_LOOKAHEAD * channels, n * channels);
+  }
+
+  for (k = 0, first = 0; first < frames; k++, first += PCM_LIMITER_LOOKAHEAD) {
+    unsigned int n = frames - first;
+    int peak = peaks[k];
+    float target = 1.0f;
+    float next;
+
+    if (n > PCM_LIMITER_LOOKAHEAD)
+      n = PCM_LIMITER_LOOKAHEAD;
+
+    if (k + 1 < segments && peaks[k + 1] > peak)
+      peak = peaks[k + 1];
+    if ((float)peak > ceiling)
+      target = ceiling / (float)peak;
+
+    next = gain + release * n;
+    if (next > target)
+      next = target;
+
+    mixer.kernels->ramp_s32(buf + first * channels, n * channels, gain, (next - gain) / n);
+    gain = next;
+  }
+
+  mixer.limiter_gain = gain;
+}
+
+static void _pcm_telemetry_update(LONGLONG start, unsigned int frames, unsigned int mixed) {
+  struct pcm_stats* s = &telemetry.stats;
+  LONGLONG budget = (LONGLONG)frames * telemetry.freq.QuadPart / mixer.rate;
+  LONGLONG used;
+  LARGE_INTEGER end;
+  unsigned int bucket;
+
+  QueryPerformanceCounter(&end);
+  used = end.QuadPart - start;
+
+  InterlockedIncrement(&telemetry.seq);
+
+  if (telemetry.reset) {
+    memset(s, 0, sizeof(*s));
+    telemetry.last_start = 0;
+    InterlockedExchange(&telemetry.reset, 0);
+  }
+
+  s->blocks++;
+  s->voices_mixed += mixed;
+  if (mixed > s->max_voices)
+    s->max_voices = mixed;
+
+  s->budget_us = (unsigned int)(budget * 1000000 / telemetry.freq.QuadPart);
+  s->last_us = (unsigned int)(used * 1000000 / telemetry.freq.QuadPart);
+  s->total_us += s->last_us;
+  if (s->last_us > s->max_us)
+    s->max_us = s->last_us;
+
+  // Tenths of the budget, anything over budget lands in the last bucket.
+  bucket = budget > 0 ? (unsigned int)(used * 10 / budget) : PCM_STATS_BUCKETS - 1;
+  if (bucket >= PCM_STATS_BUCKETS)
+    bucket = PCM_STATS_BUCKETS - 1;
+  s->histogram[bucket]++;
+
+  if (used > budget)
+    s->overruns++;
+
+  // The device has one block queued while we render the next, so if more
+  // than two periods went by since the last call it ran dry.
+  if (telemetry.last_start != 0 && start - telemetry.last_start > 2 * budget)
+    s->underruns++;
+  telemetry.last_start = start;
+
+  InterlockedIncrement(&telemetry.seq);
+}
+
+/*
+ * Mixes a playing voice's part of the block starting at mixer.frame. Returns
+ * 1 if the voice was mixed, 0 if it was silent, not due yet or virtual.
+ */
+static unsigned int _pcm_voice_render(struct pcm_voice* v, struct pcm_mix_ctx* ctx, int* accum, unsigned int frames) {
+  unsigned int offset = 0;
+  unsigned int done;
+  unsigned int lvol, rvol;
+
+  // A stream is held where it is until the I/O thread has read its start.
+  // One that was scheduled catches up with _pcm_voice_skip() below once
+  // it is ready.
+  if (v->sample->stream != NULL && !pcm_stream_ready(v->sample->stream))
+    return 0;
+
+  if (v->start != 0) {
+    if (v->start >= mixer.frame + frames)
+      return 0;
+
+    if (v->start > mixer.frame) {
+      offset = (unsigned int)(v->start - mixer.frame);
+    } else if (v->start < mixer.frame) {
+      // Scheduled too late for its frame. Catch up so it stays in phase
+      // with anything scheduled for the same frame.
+      unsigned long long late = mixer.frame - v->start;
+      _pcm_voice_skip(v, v->start, late > 0xffffffff ? 0xffffffff : (unsigned int)late);
+      if (v->ended)
+        return 0;
+    }
+
+    v->start = 0;
+  }
+
+  // Only audible voices cost a fetch, resample and mix.
+  v->virt = !_pcm_voice_gain(v, &lvol, &rvol);
+  if (v->virt) {
+    _pcm_voice_skip(v, mixer.frame + offset, frames - offset);
+    return 0;
+  }
+
+  ctx->active[v->owner->mix_bus]++;
+  done = _pcm_voice_mix(v, ctx, accum + offset * mixer.channels, frames - offset);
+  if (v->ended)
+    v->ended_at = mixer.frame + offset + done;
+
+  return 1;
+}
+
+/*
+ * Mixes up to frames frames of the voice into accum. Returns the number
+ * mixed, fewer if the voice runs out.
+ */
+static unsigned int _pcm_voice_mix(struct pcm_voice* v, struct pcm_mix_ctx* ctx, int* accum, unsigned int frames) {
+  struct pcm_player* p = v->owner;
+  struct pcm_sample* s = v->sample;
+  unsigned int done = 0;
+
+  while (done < frames) {
+    // Stepping more than one source frame per output frame can carry the
+    // read position past the end.
+    unsigned int left = v->pos < s->sample_count ? s->sample_count - v->pos : 0;
+    unsigned long long avail;
+    unsigned int n, fetch, consumed;
+
+    if (left == 0) {
+      v->pos = 0;
+      v->frac = 0;
+
+      if (p->mix_looping && s->sample_count > 0) {
+        v->anchor += s->sample_count;
+        continue;
+      }
+
+      v->ended = 1;
+      return done;
+    }
+
+    if (left > PCM_SCRATCH_FRAMES)
+      left = PCM_SCRATCH_FRAMES;
+
+    // Number of mixer frames that can be produced from the source frames we
+    // are about to fetch.
+    avail = (((unsigned long long)left << 16) - v->frac + v->step - 1) / v->step;
+    n = frames - done;
+    if (avail < n)
+      n = (unsigned int)avail;
+
+    fetch = ((v->frac + (unsigned long long)(n - 1) * v->step) >> 16) + 1;
+    consumed = (unsigned int)((v->frac + (unsigned long long)n * v->step) >> 16);
+
+    // Fetch the span plus the frames the filter reads around it.
+    fetch += PCM_RESAMPLE_HISTORY + PCM_RESAMPLE_LOOKAHEAD;
+    _pcm_voice_fetch(v, ctx->wide, (int)v->pos - PCM_RESAMPLE_HISTORY, fetch);
+
+    pcm_resample(ctx->voice, ctx->wide + PCM_RESAMPLE_HISTORY * s->channels, s->channels, n, v->frac, v->step, mixer.resample_mode);
+
+    // Gain goes on after resampling, where mono sources are stereo and can
+    // be panned.
+    _pcm_adjust_volume(ctx->voice, n, v);
+    mixer.kernels->mix_s16(accum + done * mixer.channels, ctx->voice, n * mixer.channels);
+
+    v->pos += consumed;
+    v->frac = (v->frac + n * v->step) & 0xffff;
+    done += n;
+  }
+
+  return done;
+}
+
+/*
+ * Mixes a filtered voice into the next lane of the context's filter bank,
+ * running the bank if that was its last free lane. Returns the same as
+ * _pcm_voice_render(). A voice that is not mixed keeps its filter state as
+ * it was.
+ */
+static unsigned int _pcm_voice_filter(struct pcm_voice* v, struct pcm_mix_ctx* ctx, int* accum, unsigned int frames) {
+  struct pcm_biquad_bank* bank = &ctx->bank;
+  unsigned int len = frames * mixer.channels;
+  unsigned int k = ctx->lanes;
+  unsigned int i, c;
+
+  memset(ctx->dry, 0, len * sizeof(int));
+  if (!_pcm_voice_render(v, ctx, ctx->dry, frames))
+    return 0;
+
+  // Lanes left empty when the bank runs must be silent.
+  if (k == 0)
+    memset(ctx->wet, 0, len * PCM_FILTER_LANES * sizeof(float));
+
+  for (i = 0; i < len; i++)
+    ctx->wet[i * PCM_FILTER_LANES + k] = (float)ctx->dry[i];
+
+  bank->b0[k] = v->coef[0];
+  bank->b1[k] = v->coef[1];
+  bank->b2[k] = v->coef[2];
+  bank->a1[k] = v->coef[3];
+  bank->a2[k] = v->coef[4];
+  for (c = 0; c < 2; c++) {
+    bank->z1[c][k] = v->z1[c];
+    bank->z2[c][k] = v->z2[c];
+  }
+
+  ctx->lane[k] = v;
+  if (++ctx->lanes == PCM_FILTER_LANES)
+    _pcm_filter_bank_run(ctx, accum, frames);
+
+  return 1;
+}
+
+/*
+ * Filters the voices in the context's bank into accum and hands each its
+ * new state back.
+ */
+static void _pcm_filter_bank_run(struct pcm_mix_ctx* ctx, int* accum, unsigned int frames) {
+  struct pcm_biquad_bank* bank = &ctx->bank;
+  unsigned int k, c;
+
+  for (k = ctx->lanes; k < PCM_FILTER_LANES; k++) {
+    bank->b0[k] = bank->b1[k] = bank->b2[k] = 0.0f;
+    bank->a1[k] = bank->a2[k] = 0.0f;
+    for (c = 0; c < 2; c++)
+      bank->z1[c][k] = bank->z2[c][k] = 0.0f;
+  }
+
+  mixer.kernels->biquad_bank(accum, ctx->wet, frames, bank);
+
+  for (k = 0; k < ctx->lanes; k++) {
+    struct pcm_voice* v = ctx->lane[k];
+
+    for (c = 0; c < 2; c++) {
+      v->z1[c] = fabsf(bank->z1[c][k]) < PCM_FILTER_FLOOR ? 0.0f : bank->z1[c][k];
+      v->z2[c] = fabsf(bank->z2[c][k]) < PCM_FILTER_FLOOR ? 0.0f : bank->z2[c][k];
+    }
+  }
+
+  ctx->lanes = 0;
+}
+
+/*
+ * Advances a virtual voice by frames mixer frames from mixer frame at the way
+ * _pcm_voice_mix() would, so it comes back in the right place once it is
+ * audible again.
+ */
+static void _pcm_voice_skip(struct pcm_voice* v, unsigned long long at, unsigned int frames) {
+  struct pcm_player* p = v->owner;
+  struct pcm_sample* s = v->sample;
+  unsigned long long adv = v->frac + (unsigned long long)frames * v->step;
+  unsigned long long pos = v->pos + (adv >> 16);
+
+  if (pos < s->sample_count) {
+    v->pos = (unsigned int)pos;
+    v->frac = (unsigned int)(adv & 0xffff);
+  } else if (p->mix_looping && s->sample_count > 0) {
+    v->anchor += (unsigned int)(pos - pos % s->sample_count);
+    v->pos = (unsigned int)(pos % s->sample_count);
+    v->frac = (unsigned int)(adv & 0xffff);
+  } else {
+    // Frames it would still have mixed before running out.
+    unsigned long long left = v->pos < s->sample_count ? ((unsigned long long)(s->sample_count - v->pos) << 16) - v->frac : 0;
+
+    v->ended = 1;
+    v->ended_at = at + (left + v->step - 1) / v->step;
+    return;
+  }
+
+  // Keep a stream reading while its voice is silent so the frames are there
+  // when it is mixed again.
+  if (s->stream != NULL)
+    pcm_stream_consume(s->stream, (LONG)(v->anchor + v->pos - PCM_RESAMPLE_HISTORY));
+}
+
+static void _pcm_buses_init() {
+  unsigned int i;
+
+  memset(buses, 0, sizeof(buses));
+  for (i = 0; i < PCM_BUSES; i++) {
+    buses[i].sidechain = buses[i].mix_sidechain = PCM_BUS_NONE;
+    buses[i].depth = buses[i].mix_depth = 65536;
+    buses[i].mix_volume = 65536;
+    buses[i].duck = 65536;
+    buses[i].gain = 65536;
+  }
+
+  buses[PCM_BUS_MUSIC].sidechain = buses[PCM_BUS_MUSIC].mix_sidechain = PCM_BUS_VOICE;
+  buses[PCM_BUS_MUSIC].depth = buses[PCM_BUS_MUSIC].mix_depth = PCM_DEFAULT_DUCK_DEPTH;
+  buses[PCM_BUS_MUSIC].attack_ms = buses[PCM_BUS_MUSIC].mix_attack_ms = PCM_DEFAULT_DUCK_ATTACK;
+  buses[PCM_BUS_MUSIC].release_ms = buses[PCM_BUS_MUSIC].mix_release_ms = PCM_DEFAULT_DUCK_RELEASE;
+}
+
+/*
+ * Moves each bus's ducking gain towards its target and works out the gain
+ * its voices are mixed with this block. A sidechain counts as active if it
+ * mixed anything in the previous block. Audio thread only.
+ */
+static void _pcm_buses_update(unsigned int frames) {
+  unsigned int i;
+
+  for (i = 0; i < PCM_BUSES; i++) {
+    struct pcm_bus* b = &buses[i];
+    unsigned int target = 65536;
+    unsigned int ms, step;
+
+    if (b->mix_sidechain < PCM_BUSES && buses[b->mix_sidechain].active)
+      target = b->mix_depth;
+
+    // The full swing between unity and the depth takes the attack or
+    // release time, in steps of one block.
+    ms = b->duck > target ? b->mix_attack_ms : b->mix_release_ms;
+    step = 65536;
+    if (ms > 0)
+      step = (unsigned int)(((unsigned long long)(65536 - b->mix_depth) * frames * 1000) / ((unsigned long long)ms * mixer.rate));
+    if (step == 0)
+      step = 1;
+
+    if (b->duck > target)
+      b->duck = b->duck - target > step ? b->duck - step : target;
+    else if (b->duck < target)
+      b->duck = target - b->duck > step ? b->duck + step : target;
+
+    b->gain = b->mix_mute ? 0 : (unsigned int)(((unsigned long long)b->mix_volume * b->duck) >> 16);
+  }
+
+  for (i = 0; i < PCM_BUSES; i++)
+    buses[i].active = 0;
+}
+
+static void _pcm_positions_lock() {
+  while (InterlockedCompareExchange(&positions.busy, 1, 0) != 0)
+    Sleep(0);
+}
+
+static void _pcm_positions_unlock() {
+  InterlockedExchange(&positions.busy, 0);
+}
+
+/*
+ * Picks up positions and filters posted since the last block, recomputes
+ * the pan gains of every slot if anything changed and the coefficients of
+ * the voices with new filters. Audio thread only.
+ */
+static void _pcm_positions_apply() {
+  unsigned int i;
+
+  if (positions.dirty && InterlockedCompareExchange(&positions.busy, 1, 0) == 0) {
+    for (i = 0; i < PCM_MAX_VOICES; i++) {
+      if (positions.id[i] == 0)
+        continue;
+
+      // The voice may have ended, and the slot been reused, since.
+      if (voices[i].id == positions.id[i]) {
+        mixer.pos_x[i] = positions.x[i];
+        mixer.pos_y[i] = positions.y[i];
+      }
+      positions.id[i] = 0;
+    }
+
+    for (i = 0; i < PCM_MAX_VOICES; i++) {
+      struct pcm_voice* v = &voices[i];
+
+      if (positions.filter_id[i] == 0)
+        continue;
+
+      if (v->id == positions.filter_id[i]) {
+        // A new kind of filter starts from silence, a new cutoff carries
+        // on from where the old one was.
+        if (v->filter != positions.filter[i]) {
+          v->z1[0] = v->z1[1] = 0.0f;
+          v->z2[0] = v->z2[1] = 0.0f;
+        }
+        v->filter = positions.filter[i];
+        v->cutoff = positions.cutoff[i];
+        _pcm_filter_design(v);
+      }
+      positions.filter_id[i] = 0;
+    }
+
+    mixer.near_dist = positions.near_dist;
+    mixer.far_dist = positions.far_dist;
+    mixer.pan_dirty = 1;
+
+    positions.dirty = 0;
+    _pcm_positions_unlock();
+  }
+
+  if (mixer.pan_dirty) {
+    mixer.kernels->pan_gain(mixer.pan_lgain, mixer.pan_rgain, mixer.pos_x, mixer.pos_y, PCM_MAX_VOICES, mixer.near_dist, mixer.far_dist);
+    mixer.pan_dirty = 0;
+  }
+}
+
+/*
+ * Works out a voice's biquad coefficients from its filter and cutoff at the
+ * mixer rate, from the RBJ audio EQ cookbook with Q = 1/sqrt(2).
+ */
+static void _pcm_filter_design(struct pcm_voice* v) {
+  double cutoff = v->cutoff;
+  double w, cs, alpha, a0;
+
+  if (v->filter == PCM_FILTER_NONE)
+    return;
+
+  if (cutoff < PCM_FILTER_MIN_CUTOFF)
+    cutoff = PCM_FILTER_MIN_CUTOFF;
+  if (cutoff > mixer.rate * PCM_FILTER_MAX_CUTOFF)
+    cutoff = mixer.rate * PCM_FILTER_MAX_CUTOFF;
+
+  w = 2.0 * 3.14159265358979323846 * cutoff / mixer.rate;
+  cs = cos(w);
+  alpha = sin(w) / (2.0 * 0.70710678118654752);
+  a0 = 1.0 + alpha;
+
+  if (v->filter == PCM_FILTER_LOWPASS) {
+    v->coef[0] = (float)((1.0 - cs) / 2.0 / a0);
+    v->coef[1] = (float)((1.0 - cs) / a0);
+  } else {
+    v->coef[0] = (float)((1.0 + cs) / 2.0 / a0);
+    v->coef[1] = (float)(-(1.0 + cs) / a0);
+  }
+  v->coef[2] = v->coef[0];
+  v->coef[3] = (float)(-2.0 * cs / a0);
+  v->coef[4] = (float)((1.0 - alpha) / a0);
+}
+
+static void _pcm_voice_end_of_sample(struct pcm_voice* v) {
+  // The callback runs later on the application's side of the event ring,
+  // never here.
+  _pcm_event_push(PCM_EVENT_DONE, v->owner->handle, v->id, v->ended_at);
+  _pcm_voice_free(v);
+}
+
+static DJ_RESULT _pcm_command_push(unsigned int type, struct pcm_player* p, PCM_VOICE voice, unsigned int a, unsigned int b) {
+  struct pcm_command cmd;
+
+  cmd.type = type;
+  cmd.target = p;
+  cmd.voice = voice;
+  cmd.a = a;
+  cmd.b = b;
+
+  if (!pcm_ring_push(&mixer.commands, &cmd)) {
+    return ERROR;
+  }
+
+  return NOERROR;
+}
+
+/*
+ * Drains the command ring. Called by the audio callback at the start of each
+ * block, or by another thread while the audio device is locked.
+ */
+static void _pcm_commands_apply() {
+  struct pcm_command cmd;
+
+  while (pcm_ring_pop(&mixer.commands, &cmd)) {
+    _pcm_command_apply(&cmd);
+  }
+}
+
+static void _pcm_command_apply(const struct pcm_command* cmd) {
+  struct pcm_player* p = (struct pcm_player*)cmd->target;
+  struct pcm_voice* v = NULL;
+  unsigned int i;
+
+  switch (cmd->type) {
+  case PCM_CMD_VOICE_PLAY:
+  case PCM_CMD_VOICE_STOP:
+  case PCM_CMD_VOICE_VOLUME:
+  case PCM_CMD_VOICE_PITCH:
+    // The voice may have finished since the command was queued.
+    v = _pcm_voice_lookup(cmd->voice);
+    if (v == NULL)
+      break;
+
+    if (cmd->type == PCM_CMD_VOICE_PLAY) {
+      // A group comes in as one command with its voices chained off the
+      // first.
+      _pcm_voice_start(v);
+    } else if (cmd->type == PCM_CMD_VOICE_STOP) {
+      if (v->state != STATE_STARTING)
+        _pcm_voice_free(v);
+    } else if (cmd->type == PCM_CMD_VOICE_PITCH) {
+      // Only the step changes, the sample data is shared as it is.
+      v->step = (unsigned int)(((unsigned long long)v->owner->step * cmd->a) >> 16);
+      if (v->step == 0)
+        v->step = 1;
+
+      _pcm_voice_rekey(v);
+    } else {
+      v->lvolume = cmd->a;
+      v->rvolume = cmd->b;
+      _pcm_voice_rekey(v);
+    }
+    break;
+
+  case PCM_CMD_PAUSE:
+  case PCM_CMD_RESUME:
+  case PCM_CMD_STOP:
+    // Voices still starting belong to the thread that claimed them and are
+    // left alone, their own play command is further down the ring.
+    for (i = 0; i < PCM_MAX_VOICES; i++) {
+      v = &voices[i];
+      if (v->id == 0 || v->owner != p || v->state == STATE_STARTING)
+        continue;
+
+      if (cmd->type == PCM_CMD_PAUSE && v->state == STATE_PLAYING) {
+        v->state = STATE_PAUSED;
+        _pcm_voice_rekey(v);
+      } else if (cmd->type == PCM_CMD_RESUME && v->state == STATE_PAUSED) {
+        // A scheduled voice paused past its start frame starts now rather
+        // than skipping what it missed.
+        if (v->start != 0 && v->start < mixer.frame)
+          v->start = mixer.frame;
+        v->state = STATE_PLAYING;
+        _pcm_voice_rekey(v);
+      }
+      else if (cmd->type == PCM_CMD_STOP)
+        _pcm_voice_free(v);
+    }
+    break;
+
+  case PCM_CMD_VOLUME_LEFT:
+    p->mix_lvolume = cmd->a;
+    _pcm_voices_rekey(p, PCM_BUS_NONE);
+    break;
+
+  case PCM_CMD_VOLUME_RIGHT:
+    p->mix_rvolume = cmd->a;
+    _pcm_voices_rekey(p, PCM_BUS_NONE);
+    break;
+
+  case PCM_CMD_LOOPING:
+    p->mix_looping = cmd->a;
+
+    // Looping voices never run out, so their place in the heap moves.
+    _pcm_voices_rekey(p, PCM_BUS_NONE);
+    break;
+
+  case PCM_CMD_MAX_VOICES:
+    mixer.max_voices = cmd->a;
+    while (mixer.heap_size > mixer.max_voices)
+      _pcm_voice_steal(mixer.heap[0]);
+    break;
+
+  case PCM_CMD_BUS:
+    p->mix_bus = cmd->a;
+    _pcm_voices_rekey(p, PCM_BUS_NONE);
+    break;
+
+  case PCM_CMD_BUS_VOLUME:
+    buses[cmd->a].mix_volume = cmd->b;
+    _pcm_voices_rekey(NULL, cmd->a);
+    break;
+
+  case PCM_CMD_BUS_MUTE:
+    buses[cmd->a].mix_mute = cmd->b;
+    _pcm_voices_rekey(NULL, cmd->a);
+    break;
+
+  case PCM_CMD_BUS_DUCKING:
+    buses[cmd->a].mix_sidechain = buses[cmd->a].sidechain;
+    buses[cmd->a].mix_depth = buses[cmd->a].depth;
+    buses[cmd->a].mix_attack_ms = buses[cmd->a].attack_ms;
+    buses[cmd->a].mix_release_ms = buses[cmd->a].release_ms;
+    break;
+
+  case PCM_CMD_MASTER:
+    // A limiter switched on starts from silence and unity gain.
+    if ((cmd->a & PCM_MASTER_LIMITER) && !(mixer.master & PCM_MASTER_LIMITER)) {
+      memset(mixer.accum, 0, PCM_LIMITER_LOOKAHEAD * mixer.channels * sizeof(int));
+      mixer.limiter_gain = 1.0f;
+    }
+    mixer.master = cmd->a;
+    break;
+  }
+}
+
+/*
+ * Queues a completion event. Called only by the audio thread, or with the
+ * audio device locked. The event is dropped if the application has let the
+ * ring fill up.
+ */
+static void _pcm_event_push(unsigned int type, DJ_HANDLE h, PCM_VOICE voice, unsigned long long frame) {
+  struct pcm_command evt;
+
+  evt.type = type;
+  evt.target = h;
+  evt.voice = voice;
+  evt.a = (unsigned int)frame;
+  evt.b = (unsigned int)(frame >> 32);
+
+  if (pcm_ring_push(&events.ring, &evt)) {
+    events.queued++;
+  }
+}
+
+/*
+ * Calls the sound's pcm_notify_cb for an event. The callback is copied out
+ * under a handle reference but called without one, so it may close the
+ * sound.
+ */
+static void _pcm_event_notify(const struct pcm_event* evt) {
+  struct pcm_player* p = (struct pcm_player*)dj_handle_acquire(evt->handle, DJ_HANDLE_PCM);
+  pcm_notify_cb cb = NULL;
+
+  if (p == NULL) {
+    return;
+  }
+
+  cb = p->cb;
+  dj_handle_release(evt->handle);
+
+  if (cb) {
+    cb(evt->handle);
+  }
+}
+
+static DWORD WINAPI _pcm_dispatch_proc(LPVOID param) {
+  while (WaitForSingleObject(events.ready, INFINITE) == WAIT_OBJECT_0) {
+    if (events.quit) {
+      break;
+    }
+
+    pcm_dispatch_events();
+  }
+
+  return 0;
+}
+
+/*
+ * Starts the thread that reopens the device for adaptive latency, if it is
+ * not running yet. Only the device backend has a period to change.
+ */
+static DJ_RESULT _pcm_latency_start() {
+  if (mixer.backend != PCM_BACKEND_DEVICE || latency.thread != NULL)
+    return NOERROR;
+
+  latency.wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+  if (latency.wake == NULL)
+    goto error1;
+
+  latency.quit = 0;
+  latency.thread = CreateThread(NULL, 0, _pcm_latency_proc, NULL, 0, NULL);
+  if (latency.thread == NULL)
+    goto error2;
+
+  return NOERROR;
+
+error2:
+  CloseHandle(latency.wake);
+  latency.wake = NULL;
+
+error1:
+  return ERROR;
+}
+
+static void _pcm_latency_stop() {
+  if (latency.thread == NULL)
+    return;
+
+  InterlockedExchange(&latency.quit, 1);
+  SetEvent(latency.wake);
+  WaitForSingleObject(latency.thread, INFINITE);
+
+  CloseHandle(latency.thread);
+  CloseHandle(latency.wake);
+  latency.thread = NULL;
+  latency.wake = NULL;
+}
+
+/*
+ * Reopens the device at the period the callback asked for, since the audio
+ * thread cannot reopen its own device.
+ */
+static DWORD WINAPI _pcm_latency_proc(LPVOID param) {
+  while (WaitForSingleObject(latency.wake, INFINITE) == WAIT_OBJECT_0) {
+    LONG wanted;
+
+    if (latency.quit) {
+      break;
+    }
+
+    wanted = InterlockedExchange(&latency.wanted, 0);
+    if (wanted != 0 && latency.adaptive)
+      _pcm_mixer_reopen((unsigned int)wanted, true);
+  }
+
+  return 0;
+}
+
+/*
+ * Claims a free voice from the pool and sets it up at the beginning of the
+ * player's sample. The voice is not mixed until its play command is applied.
+ */
+static struct pcm_voice* _pcm_voice_alloc(struct pcm_player* p, unsigned int priority) {
+  struct pcm_stream* st = p->sample->stream;
+  unsigned int start = (unsigned int)voice_hint;
+  unsigned int n, i;
+
+  // A stream has one read position so only one voice can play it.
+  if (st != NULL) {
+    if (InterlockedCompareExchange(&st->busy, 1, 0) != 0)
+      return NULL;
+    pcm_stream_rewind(st);
+  }
+
+  // Start after the last slot handed out, the slots behind it are the ones
+  // most likely to still be taken.
+  for (n = 0; n < PCM_MAX_VOICES; n++) {
+    struct pcm_voice* v = NULL;
+
+    i = (start + n) % PCM_MAX_VOICES;
+    v = &voices[i];
+    if (InterlockedCompareExchange(&v->claimed, 1, 0) == 0) {
+      InterlockedExchange(&voice_hint, (i + 1) % PCM_MAX_VOICES);
+
+      // The serial makes ids of recycled voices distinct so a stale id can
+      // not reach the voice that replaced it.
+      if (++v->serial > 0xffffff)
+        v->serial = 1;
+
+      v->state = STATE_STARTING;
+      v->priority = priority;
+      v->heap_index = PCM_NO_HEAP;
+      v->lvolume = 65536;
+      v->rvolume = 65536;
+      v->pos = 0;
+      v->anchor = 0;
+      v->frac = 0;
+      v->step = p->step;
+      v->virt = 0;
+      v->start = 0;
+      v->group = NULL;
+      v->sample = _pcm_sample_ref(p->sample);
+      v->owner = p;
+
+      // Publish the id last, lookups treat the voice as live from here on.
+      MemoryBarrier();
+      v->id = (v->serial << 8) | i;
+
+      return v;
+    }
+  }
+
+  if (st != NULL)
+    InterlockedExchange(&st->busy, 0);
+
+  return NULL;
+}
+
+/*
+ * Returns a voice to the pool. Only the voice's owner may call this: the
+ * audio thread, the thread that claimed it before its play command was
+ * queued, or a thread holding the audio device lock.
+ */
+static void _pcm_voice_free(struct pcm_voice* v) {
+  // Only started voices are in the heap and only the audio thread, or a
+  // thread holding the device lock, frees those.
+  if (v->heap_index != PCM_NO_HEAP)
+    _pcm_heap_remove(v);
+
+  if (v->sample->stream != NULL)
+    InterlockedExchange(&v->sample->stream->busy, 0);
+
+  _pcm_sample_release(v->sample);
+
+  v->id = 0;
+  v->state = STATE_STOPPED;
+  v->sample = NULL;
+  v->owner = NULL;
+
+  InterlockedExchange(&v->claimed, 0);
+}
+
+/*
+ * Applies the play command of a voice and the rest of its group. When the
+ * voice budget is full the group's least important voice has to beat as
+ * many playing voices as it takes to make room for the whole group. If it
+ * does those are dropped, otherwise the whole group is. Audio thread only.
+ */
+static void _pcm_voice_start(struct pcm_voice* head) {
+  struct pcm_voice* least = NULL;
+  struct pcm_voice* v;
+  struct pcm_voice* next;
+  unsigned int count = 0;
+  unsigned int need = 0;
+  unsigned int beaten = 0;
+  unsigned int i;
+
+  for (v = head; v != NULL; v = v->group) {
+    unsigned int slot = (unsigned int)(v - voices);
+
+    if (v->state != STATE_STARTING)
+      continue;
+
+    _pcm_voice_rekey(v);
+
+    // Voices start on top of the listener, at full gain in both channels.
+    mixer.pos_x[slot] = 0.0f;
+    mixer.pos_y[slot] = 0.0f;
+    mixer.pan_lgain[slot] = 65536;
+    mixer.pan_rgain[slot] = 65536;
+
+    v->filter = PCM_FILTER_NONE;
+    v->z1[0] = v->z1[1] = 0.0f;
+    v->z2[0] = v->z2[1] = 0.0f;
+
+    if (least == NULL || _pcm_voice_cmp(v, least) < 0)
+      least = v;
+    count++;
+  }
+
+  if (mixer.heap_size + count > mixer.max_voices) {
+    need = mixer.heap_size + count - mixer.max_voices;
+    for (i = 0; i < mixer.heap_size; i++) {
+      if (_pcm_voice_cmp(least, mixer.heap[i]) > 0)
+        beaten++;
+    }
+  }
+
+  // The voices it beats include the need least important ones, which come
+  // off the top of the heap in turn.
+  if (beaten >= need) {
+    for (i = 0; i < need; i++)
+      _pcm_voice_steal(mixer.heap[0]);
+  }
+
+  for (v = head; v != NULL; v = next) {
+    next = v->group;
+    v->group = NULL;
+
+    if (v->state != STATE_STARTING)
+      continue;
+
+    if (beaten < need) {
+      _pcm_voice_steal(v);
+      continue;
+    }
+
+    v->state = STATE_PLAYING;
+    _pcm_heap_insert(v);
+  }
+}
+
+static void _pcm_voice_steal(struct pcm_voice* v) {
+  // Cut off at the start of the block being mixed.
+  _pcm_event_push(PCM_EVENT_STOLEN, v->owner->handle, v->id, mixer.frame);
+  _pcm_voice_free(v);
+}
+
+/*
+ * The mixer frame a voice will finish on if nothing changes, from the frame
+ * the block being mixed started on. Paused voices are going nowhere.
+ */
+static unsigned long long _pcm_voice_end(struct pcm_voice* v) {
+  struct pcm_player* p = v->owner;
+  unsigned long long left;
+
+  if (p->mix_looping || v->state == STATE_PAUSED)
+    return ~0ULL;
+
+  if (v->pos >= v->sample->sample_count)
+    return mixer.frame;
+
+  left = ((unsigned long long)(v->sample->sample_count - v->pos) << 16) - v->frac;
+
+  return (v->start > mixer.frame ? v->start : mixer.frame) + left / v->step;
+}
+
+/*
+ * Orders voices by priority, then by how much is left to play, then by
+ * how loud the voice, handle and bus volumes make it. Returns < 0 if a is
+ * less important than b.
+ */
+static int _pcm_voice_cmp(const struct pcm_voice* a, const struct pcm_voice* b) {
+  if (a->priority != b->priority)
+    return a->priority < b->priority ? -1 : 1;
+
+  if (a->end != b->end)
+    return a->end < b->end ? -1 : 1;
+
+  if (a->loudness != b->loudness)
+    return a->loudness < b->loudness ? -1 : 1;
+
+  return 0;
+}
+
+/*
+ * Works out the parts of a voice's heap key that commands change and moves
+ * it to its new place if it is in the heap. Bus ducking and positions move
+ * every block and are left out. Audio thread only.
+ */
+static void _pcm_voice_rekey(struct pcm_voice* v) {
+  struct pcm_player* p = v->owner;
+  struct pcm_bus* b = &buses[p->mix_bus];
+  unsigned long long l = ((unsigned long long)p->mix_lvolume * v->lvolume) >> 16;
+  unsigned long long r = ((unsigned long long)p->mix_rvolume * v->rvolume) >> 16;
+  unsigned long long vol = l > r ? l : r;
+
+  vol = b->mix_mute ? 0 : (vol * b->mix_volume) >> 16;
+
+  v->end = _pcm_voice_end(v);
+  v->loudness = vol > 0xffffffff ? 0xffffffff : (unsigned int)vol;
+
+  if (v->heap_index != PCM_NO_HEAP)
+    _pcm_heap_update(v);
+}
+
+/*
+ * Re-keys every started voice of player p, or with p NULL every one playing
+ * through bus.
+ */
+static void _pcm_voices_rekey(struct pcm_player* p, unsigned int bus) {
+  unsigned int i;
+
+  for (i = 0; i < PCM_MAX_VOICES; i++) {
+    struct pcm_voice* v = &voices[i];
+
+    if (v->heap_index == PCM_NO_HEAP)
+      continue;
+
+    if (p != NULL ? v->owner == p : v->owner->mix_bus == bus)
+      _pcm_voice_rekey(v);
+  }
+}
+
+static void _pcm_heap_insert(struct pcm_voice* v) {
+  v->heap_index = mixer.heap_size;
+  mixer.heap[mixer.heap_size++] = v;
+  _pcm_heap_up(v->heap_index);
+}
+
+static void _pcm_heap_remove(struct pcm_voice* v) {
+  unsigned int i = v->heap_index;
+  struct pcm_voice* last = mixer.heap[--mixer.heap_size];
+
+  v->heap_index = PCM_NO_HEAP;
+  if (last == v)
+    return;
+
+  mixer.heap[i] = last;
+  last->heap_index = i;
+  _pcm_heap_update(last);
+}
+
+static void _pcm_heap_update(struct pcm_voice* v) {
+  _pcm_heap_up(v->heap_index);
+  _pcm_heap_down(v->heap_index);
+}
+
+static void _pcm_heap_up(unsigned int i) {
+  struct pcm_voice* v = mixer.heap[i];
+
+  while (i > 0) {
+    unsigned int parent = (i - 1) / 2;
+    if (_pcm_voice_cmp(v, mixer.heap[parent]) >= 0)
+      break;
+
+    mixer.heap[i] = mixer.heap[parent];
+    mixer.heap[i]->heap_index = i;
+    i = parent;
+  }
+
+  mixer.heap[i] = v;
+  v->heap_index = i;
+}
+
+static void _pcm_heap_down(unsigned int i) {
+  struct pcm_voice* v = mixer.heap[i];
+
+  for (;;) {
+    unsigned int child = i * 2 + 1;
+    if (child >= mixer.heap_size)
+      break;
+
+    if (child + 1 < mixer.heap_size && _pcm_voice_cmp(mixer.heap[child + 1], mixer.heap[child]) < 0)
+      child++;
+
+    if (_pcm_voice_cmp(mixer.heap[child], v) >= 0)
+      break;
+
+    mixer.heap[i] = mixer.heap[child];
+    mixer.heap[i]->heap_index = i;
+    i = child;
+  }
+
+  mixer.heap[i] = v;
+  v->heap_index = i;
+}
+
+/*
+ * Maps a voice id to its pool entry. Returns NULL if the voice has finished
+ * or the id is stale. Outside the audio thread the answer can be out of date
+ * by the time it is used.
+ */
+static struct pcm_voice* _pcm_voice_lookup(PCM_VOICE id) {
+  struct pcm_voice* v = NULL;
+
+  if (id == PCM_INVALID_VOICE || PCM_VOICE_SLOT(id) >= PCM_MAX_VOICES)
+    return NULL;
+
+  v = &voices[PCM_VOICE_SLOT(id)];
+  if (v->id != id)
+    return NULL;
+
+  return v;
+}
+
+/*
+ * Returns a bit mask of (1 << state) for every active voice of the player. A
+ * voice waiting for its play command already counts as playing.
+ */
+static unsigned int _pcm_player_voice_states(struct pcm_player* p) {
+  unsigned int i, state, states = 0;
+
+  for (i = 0; i < PCM_MAX_VOICES; i++) {
+    if (voices[i].id != 0 && voices[i].owner == p) {
+      state = voices[i].state;
+      if (state == STATE_STARTING)
+        state = STATE_PLAYING;
+      states |= 1 << state;
+    }
+  }
+
+  return states;
+}
+
+static struct pcm_player* _pcm_player_pool_remove() {
+  struct pcm_player* p = NULL;
+  WaitForSingleObject(pool_mutex, INFINITE);
+  if (pool != NULL) { // if a player is available in the pool, grab that
+    p = pool;
+    pool = pool->next;
+    ReleaseMutex(pool_mutex);
+
+    p->looping = p->mix_looping = 0;
+    p->lvolume = p->mix_lvolume = 65536;
+    p->rvolume = p->mix_rvolume = 65536;
+    p->bus = p->mix_bus = PCM_BUS_SFX;
+    p->sample = NULL;
+    p->next = NULL;
+    p->cb = NULL;
+  }
+
+  ReleaseMutex(pool_mutex);
+  return p;
+}
+
+static struct pcm_player* _pcm_player_load(pcm_notify_cb callback) {
+  struct pcm_player* p = NULL;
+
+  p = _pcm_player_pool_remove();
+  if(p == NULL) { // otherwise, create a new one
+
+    p = (struct pcm_player*)malloc(sizeof(struct pcm_player));
+    if (p != NULL) {
+      p->looping = p->mix_looping = 0;
+      p->lvolume = p->mix_lvolume = 65536;
+      p->rvolume = p->mix_rvolume = 65536;
+      p->bus = p->mix_bus = PCM_BUS_SFX;
       p->sample = NULL;
       p->next = NULL;
       p->cb = NULL;
-
-      p->mutex = CreateMutex(NULL, FALSE, NULL);
-      if (p->mutex == NULL) {
-        fprintf(stderr, "CreateMutex failed %lu\n", GetLastError());
-        goto error1;
-      }
     }
   }
-  
+
   if (p != NULL) {
     p->cb = callback;
   }
 
   return p;
-
-error1:
-  free(p);
-  return NULL;
 }
 
 static void _pcm_player_free(struct pcm_player* p) {
@@ -534,13 +2995,12 @@ static void _pcm_player_free(struct pcm_player* p) {
     return;
   }
 
-  CloseHandle(p->mutex);
   free(p);
 }
 
 static void _pcm_player_unload(struct pcm_player* p) {
   if (p->sample) {
-    _pcm_sample_free(p->sample);
+    _pcm_sample_release(p->sample);
     p->sample = NULL;
   }
 
@@ -554,28 +3014,56 @@ static void _pcm_player_pool_add(struct pcm_player* p) {
   ReleaseMutex(pool_mutex);
 }
 
-static struct pcm_sample* _pcm_sample_create(unsigned char* buf, unsigned int len) {
+static struct pcm_sample* _pcm_sample_create(unsigned char* buf, unsigned int len, unsigned int flags) {
   struct pcm_sample* s = (struct pcm_sample*)malloc(sizeof(struct pcm_sample));
   if (s == NULL)
     goto error1;
 
   struct dmx_header* dmx = (struct dmx_header*)buf;
 
+  // The samples may be referenced in place so the header has to describe
+  // data that is really inside the buffer.
+  if (len < sizeof(struct dmx_header) || dmx->length < 32 || dmx->length - 32 > len - sizeof(struct dmx_header))
+    goto error2;
+
   unsigned short formatNumber = dmx->format; // always 3
 
+  s->refs = 1;
   s->sample_rate = dmx->sample_rate;
+  if (s->sample_rate == 0)
+    goto error2;
+
   s->sample_count = dmx->length - 32; // length includes 16 bytes buffer on each end of samples
   s->sample_size = 8;
   s->channels = 1;
-  s->raw_bytes = s->ptr = (unsigned char*)malloc(s->sample_count);
-  if (s->raw_bytes == NULL)
-    goto error2;
+  s->stream = NULL;
+
+  // Samples that are converted are only read once, straight from buf.
+  if (flags & (PCM_OPEN_NOCOPY | PCM_OPEN_NATIVE | PCM_OPEN_ADPCM)) {
+    s->raw_bytes = dmx->samples;
+    s->owns_bytes = false;
+  } else {
+    s->raw_bytes = (unsigned char*)malloc(s->sample_count);
+    if (s->raw_bytes == NULL)
+      goto error2;
 
-  memcpy(s->raw_bytes, &dmx->samples, s->sample_count);
+    memcpy(s->raw_bytes, &dmx->samples, s->sample_count);
+    s->owns_bytes = true;
+  }
   s->raw_len = s->sample_count;
 
+  if ((flags & PCM_OPEN_NATIVE) && _pcm_sample_convert(s) != NOERROR)
+    goto error3;
+
+  if ((flags & PCM_OPEN_ADPCM) && _pcm_sample_compress(s) != NOERROR)
+    goto error3;
+
   return s;
 
+error3:
+  if (s->owns_bytes)
+    free(s->raw_bytes);
+
 error2:
   free(s);
 
@@ -583,31 +3071,167 @@ error1:
   return NULL;
 }
 
-static void _pcm_sample_free(struct pcm_sample* s) {
-  if (s != NULL) {
-    free(s->raw_bytes);
-    free(s);
+/*
+ * Replaces the sample data with s16 at the mixer rate so voices playing it at
+ * normal pitch are only copied, gained and added. The rate conversion uses
+ * the sinc filter whatever the mixer's resample mode since it only runs once.
+ */
+static DJ_RESULT _pcm_sample_convert(struct pcm_sample* s) {
+  unsigned int step = _pcm_mixer_step(s->sample_rate);
+  unsigned int channels = s->channels;
+  unsigned long long count = (((unsigned long long)s->sample_count << 16) + step - 1) / step;
+  unsigned int padded = PCM_RESAMPLE_HISTORY + s->sample_count + PCM_RESAMPLE_LOOKAHEAD;
+  short tmp[MAX_BUFFER_SIZE * 2];
+  unsigned int done = 0, i;
+  short* in;
+  short* out;
+
+  if (count == 0 || count > 0x7fffffff / (channels * sizeof(short)))
+    goto error1;
+
+  // Silence on either side of the samples for the filter to read.
+  in = (short*)calloc(padded * channels, sizeof(short));
+  if (in == NULL)
+    goto error1;
+
+  out = (short*)malloc((size_t)count * channels * sizeof(short));
+  if (out == NULL)
+    goto error2;
+
+  if (s->sample_size == 8)
+    mixer.kernels->widen_u8(in + PCM_RESAMPLE_HISTORY * channels, s->raw_bytes, s->sample_count * channels);
+  else
+    memcpy(in + PCM_RESAMPLE_HISTORY * channels, s->raw_bytes, s->sample_count * channels * sizeof(short));
+
+  // The resampler always writes stereo, mono samples keep the left side.
+  while (done < count) {
+    unsigned long long pos = (unsigned long long)done * step;
+    unsigned int n = (unsigned int)count - done;
+
+    if (n > MAX_BUFFER_SIZE)
+      n = MAX_BUFFER_SIZE;
+
+    pcm_resample(tmp, in + (PCM_RESAMPLE_HISTORY + (pos >> 16)) * channels, channels, n, (unsigned int)(pos & 0xffff), step, PCM_RESAMPLE_SINC);
+
+    if (channels == 2) {
+      memcpy(out + done * 2, tmp, n * 2 * sizeof(short));
+    } else {
+      for (i = 0; i < n; i++)
+        out[done + i] = tmp[i * 2];
+    }
+
+    done += n;
   }
+
+  free(in);
+
+  if (s->owns_bytes)
+    free(s->raw_bytes);
+
+  s->raw_bytes = (unsigned char*)out;
+  s->raw_len = (unsigned int)count * channels * sizeof(short);
+  s->owns_bytes = true;
+  s->sample_rate = mixer.rate;
+  s->sample_size = 16;
+  s->sample_count = (unsigned int)count;
+
+  return NOERROR;
+
+error2:
+  free(in);
+
+error1:
+  return ERROR;
 }
 
-static boolean _pcm_is_handle_valid(DJ_HANDLE h) {
-  boolean res = false;
-  if (h != NULL) {
-    WaitForSingleObject(players_mutex, INFINITE);
-    struct pcm_player* p = players;
+/*
+ * Replaces the sample data with IMA ADPCM blocks, decoded by
+ * _pcm_voice_fetch() as voices play them.
+ */
+static DJ_RESULT _pcm_sample_compress(struct pcm_sample* s) {
+  unsigned int channels = s->channels;
+  unsigned int size;
+  unsigned char* out;
+  short* in = NULL;
 
-    while (p != NULL) {
-      if (p == h) {
-        res = true;
-        break;
-      } else {
-        p = p->next;
-      }
-    }
-    ReleaseMutex(players_mutex);
+  if (s->sample_count == 0 || s->sample_count > 0x7fffffff / (channels * sizeof(short)))
+    goto error1;
+
+  size = pcm_adpcm_size(channels, s->sample_count);
+  out = (unsigned char*)malloc(size);
+  if (out == NULL)
+    goto error1;
+
+  if (s->sample_size == 8) {
+    in = (short*)malloc(s->sample_count * channels * sizeof(short));
+    if (in == NULL)
+      goto error2;
+
+    mixer.kernels->widen_u8(in, s->raw_bytes, s->sample_count * channels);
+    pcm_adpcm_encode(out, in, channels, s->sample_count);
+    free(in);
+  } else {
+    pcm_adpcm_encode(out, (const short*)s->raw_bytes, channels, s->sample_count);
   }
 
-  return res;
+  if (s->owns_bytes)
+    free(s->raw_bytes);
+
+  s->raw_bytes = out;
+  s->raw_len = size;
+  s->owns_bytes = true;
+  s->sample_size = 4;
+
+  return NOERROR;
+
+error2:
+  free(out);
+
+error1:
+  return ERROR;
+}
+
+static struct pcm_sample* _pcm_sample_stream(const char* filename) {
+  struct pcm_sample* s = (struct pcm_sample*)malloc(sizeof(struct pcm_sample));
+  if (s == NULL)
+    goto error1;
+
+  s->stream = pcm_stream_open(filename);
+  if (s->stream == NULL)
+    goto error2;
+
+  // The ring always holds s16 frames.
+  s->refs = 1;
+  s->sample_rate = s->stream->rate;
+  s->sample_size = 16;
+  s->sample_count = s->stream->frames;
+  s->channels = s->stream->channels;
+  s->raw_bytes = NULL;
+  s->raw_len = 0;
+  s->owns_bytes = false;
+
+  return s;
+
+error2:
+  free(s);
+
+error1:
+  return NULL;
+}
+
+static struct pcm_sample* _pcm_sample_ref(struct pcm_sample* s) {
+  InterlockedIncrement(&s->refs);
+  return s;
+}
+
+static void _pcm_sample_release(struct pcm_sample* s) {
+  if (s != NULL && InterlockedDecrement(&s->refs) == 0) {
+    if (s->stream != NULL)
+      pcm_stream_close(s->stream);
+    if (s->owns_bytes)
+      free(s->raw_bytes);
+    free(s);
+  }
 }
 
 static struct pcm_player* _pcm_player_list_add(struct pcm_player* p) {
@@ -619,7 +3243,7 @@ static struct pcm_player* _pcm_player_list_add(struct pcm_player* p) {
   return players;
 }
 
-static struct pcm_player* _pcm_player_list_remove(DJ_HANDLE h) {
+static struct pcm_player* _pcm_player_list_remove(struct pcm_player* h) {
   struct pcm_player* p = NULL;
   if (h != NULL) {
     WaitForSingleObject(players_mutex, INFINITE);
@@ -645,84 +3269,313 @@ static struct pcm_player* _pcm_player_list_remove(DJ_HANDLE h) {
   return p;
 }
 
-static struct pcm_player* _pcm_stream_open(struct pcm_player* p) {
+static DJ_RESULT _pcm_mixer_open(unsigned int backend) {
+  mixer.backend = backend;
+  mixer.device = 0;
+  mixer.render_mutex = NULL;
+  mixer.device_mutex = NULL;
+
+  // Nothing drives the callback but pcm_render_wav(), which renders at the
+  // mixer's native format.
+  if (backend == PCM_BACKEND_NULL) {
+    mixer.rate = PCM_MIXER_RATE;
+    mixer.channels = PCM_MIXER_CHANNELS;
+
+    mixer.render_mutex = CreateMutex(NULL, FALSE, NULL);
+    if (mixer.render_mutex == NULL)
+      return ERROR;
+
+    latency.period = MAX_BUFFER_SIZE;
+    return NOERROR;
+  }
+
+  mixer.device_mutex = CreateMutex(NULL, FALSE, NULL);
+  if (mixer.device_mutex == NULL)
+    return ERROR;
+
+  return _pcm_mixer_open_device(latency.requested);
+}
+
+static DJ_RESULT _pcm_mixer_open_device(unsigned int period) {
   SDL_AudioSpec audioSpec, have;
-  SDL_AudioDeviceID id;
 
   SDL_memset(&audioSpec, 0, sizeof(audioSpec)); /* or SDL_zero(want) */
 
-  audioSpec.format = AUDIO_U8;
-  audioSpec.channels = p->sample->channels;
-  audioSpec.freq = p->sample->sample_rate;
-  audioSpec.samples = MAX_BUFFER_SIZE;
-  audioSpec.userdata = p;
+  audioSpec.format = AUDIO_S16;
+  audioSpec.channels = PCM_MIXER_CHANNELS;
+  audioSpec.freq = PCM_MIXER_RATE;
+  audioSpec.samples = (Uint16)period;
+  audioSpec.userdata = &mixer;
   audioSpec.callback = _pcm_audio_callback;
 
-  id = SDL_OpenAudioDevice(NULL, 0, &audioSpec, &have, 0);
+  // No changes allowed, SDL converts to the device format if it has to.
+  mixer.device = SDL_OpenAudioDevice(NULL, 0, &audioSpec, &have, 0);
+  if (mixer.device == 0) {
+    printf("_pcm_mixer_open(): SDL_OpenAudioDevice %s\n", SDL_GetError());
+    return ERROR;
+  }
 
-  p->sample->silence = have.silence;
+  mixer.rate = have.freq;
+  mixer.channels = have.channels;
+  latency.period = have.samples;
+  latency.last_start = 0;
+  latency.clean = 0;
 
-  p->device = id;
+  // The device runs for the lifetime of the mixer and renders silence while
+  // nothing is playing.
+  if (SDL_PlayAudioDevice(mixer.device) < 0) {
+    printf("_pcm_mixer_open(): SDL_PlayAudioDevice %s\n", SDL_GetError());
+  }
 
-  return p;
+  return NOERROR;
 }
 
-static void _pcm_stream_close(struct pcm_player* p) {
-  SDL_CloseAudioDevice(p->device);
-}
+/*
+ * Closes the device and opens it again with a new period. Voices, buses and
+ * the mix clock live in the mixer, so playback carries on where it stopped
+ * after a short gap. Falls back to the old period if the new one fails, and
+ * to PCM_BACKEND_NULL if that fails too, so the mixer keeps a backend it
+ * can lock. The output is gone then and pcm_get_latency() says so.
+ *
+ * adaptive is set for the latency thread's reopens, which are dropped if
+ * pcm_set_latency() fixed the period while the thread waited.
+ */
+static DJ_RESULT _pcm_mixer_reopen(unsigned int period, boolean adaptive) {
+  unsigned int old;
+  DJ_RESULT err = NOERROR;
+
+  // Only a device backend has a device mutex. Once lost it stays NULL.
+  if (mixer.backend != PCM_BACKEND_DEVICE)
+    return latency.lost ? ERROR : NOERROR;
+
+  WaitForSingleObject(mixer.device_mutex, INFINITE);
+
+  // Another reopen may have run, or lost the device, while this one waited.
+  old = latency.period;
+  if (mixer.backend != PCM_BACKEND_DEVICE) {
+    ReleaseMutex(mixer.device_mutex);
+    return ERROR;
+  }
+  if (period == old || (adaptive && !latency.adaptive)) {
+    ReleaseMutex(mixer.device_mutex);
+    return NOERROR;
+  }
+
+  SDL_CloseAudioDevice(mixer.device);
+  mixer.device = 0;
+
+  err = _pcm_mixer_open_device(period);
+  if (err != NOERROR && _pcm_mixer_open_device(old) != NOERROR) {
+    mixer.render_mutex = CreateMutex(NULL, FALSE, NULL);
+    mixer.rate = PCM_MIXER_RATE;
+    mixer.channels = PCM_MIXER_CHANNELS;
+    latency.period = MAX_BUFFER_SIZE;
+    InterlockedExchange(&latency.lost, 1);
+
+    // Threads waiting in _pcm_mixer_lock() see this once they have the
+    // device mutex.
+    MemoryBarrier();
+    mixer.backend = PCM_BACKEND_NULL;
+  }
 
+  InterlockedIncrement(&latency.resizes);
+  ReleaseMutex(mixer.device_mutex);
 
+  return err;
+}
 
+static void _pcm_mixer_close() {
+  if (mixer.device != 0) {
+    SDL_CloseAudioDevice(mixer.device);
+    mixer.device = 0;
+  }
 
-static unsigned int _pcm_adjust_volume(unsigned char* out, unsigned int len, struct pcm_player* p) {
-  unsigned int i, length;
+  if (mixer.device_mutex != NULL) {
+    CloseHandle(mixer.device_mutex);
+    mixer.device_mutex = NULL;
+  }
 
-  unsigned int lvol = p->lvolume;
-  unsigned int rvol = p->rvolume;
+  if (mixer.render_mutex != NULL) {
+    CloseHandle(mixer.render_mutex);
+    mixer.render_mutex = NULL;
+  }
+}
 
-  if (p->sample->channels == 1)
-    rvol = lvol;
+/*
+ * Keeps the callback from running, whichever backend drives it.
+ */
+static void _pcm_mixer_lock() {
+  if (mixer.backend == PCM_BACKEND_NULL) {
+    WaitForSingleObject(mixer.render_mutex, INFINITE);
+  } else {
+    WaitForSingleObject(mixer.device_mutex, INFINITE);
 
-  switch (p->sample->sample_size) {
-  case 8:
-    length = len;
-    lvol >>= 8;
-    rvol >>= 8;
-    for (i = 0; i < length; i++) {
-      out[i] = (((int)out[i] - 128) * lvol / 256) + 128;
-      i++;
-      if (i < length)
-        out[i] = (((int)out[i] - 128) * rvol / 256) + 128;
+    // The device was lost while this thread waited.
+    if (mixer.backend == PCM_BACKEND_NULL) {
+      ReleaseMutex(mixer.device_mutex);
+      WaitForSingleObject(mixer.render_mutex, INFINITE);
+      return;
     }
-    break;
-  case 16:
-  {
-    short* s = (short*)out;
-    length = len / 2;
-    for (i = 0; i < length; i++) {
-      s[i] = s[i] * lvol / 65536;
-      i++;
-      if (i < length)
-        s[i] = s[i] * rvol / 65536;
-    }
-  }
-  break;
-  default:
-    break;
+
+    SDL_LockAudioDevice(mixer.device);
+  }
+}
+
+static void _pcm_mixer_unlock() {
+  if (mixer.backend == PCM_BACKEND_NULL) {
+    ReleaseMutex(mixer.render_mutex);
+  } else {
+    SDL_UnlockAudioDevice(mixer.device);
+    ReleaseMutex(mixer.device_mutex);
   }
+}
+
+static void _pcm_put_le32(unsigned char* out, unsigned int val) {
+  out[0] = (unsigned char)(val);
+  out[1] = (unsigned char)(val >> 8);
+  out[2] = (unsigned char)(val >> 16);
+  out[3] = (unsigned char)(val >> 24);
+}
+
+static void _pcm_put_le16(unsigned char* out, unsigned int val) {
+  out[0] = (unsigned char)(val);
+  out[1] = (unsigned char)(val >> 8);
+}
+
+static unsigned int _pcm_mixer_step(unsigned int sample_rate) {
+  return (unsigned int)(((unsigned long long)sample_rate << 16) / mixer.rate);
+}
+
+/*
+ * Works out the s16 gain, 0 - 32768, the mixer applies to each output
+ * channel of a voice. Returns false if both are 0 and the voice would mix
+ * to silence.
+ */
+static boolean _pcm_voice_gain(struct pcm_voice* v, unsigned int* lvol, unsigned int* rvol) {
+  unsigned int slot = (unsigned int)(v - voices);
+
+  // The handle volume scales every voice playing it, then the bus it plays
+  // through, then the voice's position pans and attenuates it.
+  unsigned int bus = buses[v->owner->mix_bus].gain;
+  unsigned long long l = ((unsigned long long)v->owner->mix_lvolume * v->lvolume) >> 16;
+  unsigned long long r = ((unsigned long long)v->owner->mix_rvolume * v->rvolume) >> 16;
+
+  l = (l * bus) >> 16;
+  r = (r * bus) >> 16;
+
+  if (v->sample->channels == 1)
+    r = l;
+
+  if (l > 65536)
+    l = 65536;
+  if (r > 65536)
+    r = 65536;
+
+  l = (l * mixer.pan_lgain[slot]) >> 16;
+  r = (r * mixer.pan_rgain[slot]) >> 16;
+
+  *lvol = (unsigned int)(l >> 1);
+  *rvol = (unsigned int)(r >> 1);
+
+  return (*lvol | *rvol) != 0;
+}
+
+/*
+ * Applies a voice's gain to a block of resampled stereo frames.
+ */
+static unsigned int _pcm_adjust_volume(short* out, unsigned int frames, struct pcm_voice* v) {
+  unsigned int lvol, rvol;
+
+  _pcm_voice_gain(v, &lvol, &rvol);
+  mixer.kernels->gain_s16(out, frames * mixer.channels, lvol, rvol);
 
   return 0;
 }
 
+/*
+ * Copies count source frames starting at frame first into dst as s16. Frames
+ * before the start of the sample are silence. Frames past the end are
+ * silence, or the start of the sample again if the sound is looping.
+ */
+static void _pcm_voice_fetch(struct pcm_voice* v, short* dst, int first, unsigned int count) {
+  struct pcm_sample* s = v->sample;
+  unsigned int channels = s->channels;
+  unsigned int base = v->anchor; // stream frame of the pass first is in
+
+  // Nothing before this is read again, the stream's ring can reuse it.
+  if (s->stream != NULL)
+    pcm_stream_consume(s->stream, (LONG)(base + (first > 0 ? first : 0)));
+
+  while (count > 0) {
+    unsigned int n = count;
+
+    if (first < 0) {
+      if ((unsigned int)-first < n)
+        n = -first;
+      memset(dst, 0, n * channels * sizeof(short));
+    } else if ((unsigned int)first < s->sample_count) {
+      if (s->sample_count - first < n)
+        n = s->sample_count - first;
+      if (s->stream != NULL)
+        pcm_stream_fetch(s->stream, dst, (LONG)(base + first), n);
+      else if (s->sample_size == 4)
+        _pcm_adpcm_fetch(s, dst, first, n);
+      else if (s->sample_size == 8)
+        mixer.kernels->widen_u8(dst, s->raw_bytes + first * channels, n * channels);
+      else
+        memcpy(dst, (const short*)s->raw_bytes + first * channels, n * channels * sizeof(short));
+    } else if (v->owner->mix_looping && s->sample_count > 0) {
+      base += first - first % s->sample_count;
+      first %= s->sample_count;
+      continue;
+    } else {
+      memset(dst, 0, n * channels * sizeof(short));
+    }
+
+    dst += n * channels;
+    first += n;
+    count -= n;
+  }
+}
+
+/*
+ * Decodes count frames of an ADPCM sample starting at frame first, all
+ * inside the sample. Whole blocks decode straight into dst, only a partly
+ * used block at either end goes through tmp, so a fetch decodes at most two
+ * blocks' worth of frames it does not need.
+ */
+static void _pcm_adpcm_fetch(const struct pcm_sample* s, short* dst, unsigned int first, unsigned int count) {
+  short tmp[PCM_ADPCM_BLOCK_FRAMES * 2];
+  unsigned int channels = s->channels;
+
+  while (count > 0) {
+    unsigned int block = first / PCM_ADPCM_BLOCK_FRAMES;
+    unsigned int skip = first % PCM_ADPCM_BLOCK_FRAMES;
+    unsigned int n = PCM_ADPCM_BLOCK_FRAMES - skip;
+
+    if (n > count)
+      n = count;
+
+    if (n == PCM_ADPCM_BLOCK_FRAMES) {
+      pcm_adpcm_decode(dst, s->raw_bytes, channels, block);
+    } else {
+      pcm_adpcm_decode(tmp, s->raw_bytes, channels, block);
+      memcpy(dst, tmp + skip * channels, n * channels * sizeof(short));
+    }
+
+    dst += n * channels;
+    first += n;
+    count -= n;
+  }
+}
 
 #ifdef PCM_PLAYER_STANDALONE
 
 DJ_RESULT pcm_volume_left(DJ_HANDLE h, unsigned int dir) {
   unsigned int vol = 0;
   const unsigned int val = 3277;
-  struct pcm_player* p = (struct pcm_player*)h;
 
-  if(!_pcm_is_handle_valid(h)) {
+  if (dj_handle_acquire(h, DJ_HANDLE_PCM) == NULL) {
     return INVALID_PARAM;
   }
 
@@ -741,15 +3594,16 @@ DJ_RESULT pcm_volume_left(DJ_HANDLE h, unsigned int dir) {
   }
 
   pcm_set_volume_left(h, vol);
+
+  dj_handle_release(h);
   return NOERROR;
 }
 
 DJ_RESULT pcm_volume_right(DJ_HANDLE h, unsigned int dir) {
   unsigned int vol = 0;
   const unsigned int val = 3277;
-  struct pcm_player* p = (struct pcm_player*)h;
 
-  if (!_pcm_is_handle_valid(h)) {
+  if (dj_handle_acquire(h, DJ_HANDLE_PCM) == NULL) {
     return INVALID_PARAM;
   }
 
@@ -768,6 +3622,8 @@ DJ_RESULT pcm_volume_right(DJ_HANDLE h, unsigned int dir) {
   }
 
   pcm_set_volume_right(h, vol);
+
+  dj_handle_release(h);
   return NOERROR;
 }
 
@@ -785,6 +3641,87 @@ void standalone_callback(void* data) {
   printf("\r       \rStopped");
 }
 
+/*
+ * Renders the sample looping on the given number of voices with no audio
+ * device and reports how much faster than real time the mixer ran.
+ */
+int standalone_render(unsigned char* filename, unsigned int nvoices, unsigned int seconds, const char* outname) {
+  unsigned char* wavbuf = NULL;
+  unsigned int wavbuflen = 0;
+  LARGE_INTEGER freq, start, end;
+  double wall;
+  unsigned int i;
+  DJ_HANDLE s;
+
+  if (pcm_init_ex(PCM_BACKEND_NULL) != NOERROR) {
+    fprintf(stderr, "Failed to initialize the mixer\n");
+    return EXIT_FAILURE;
+  }
+
+  wavbuf = load_file(filename, &wavbuflen);
+  if (wavbuf == NULL) {
+    fprintf(stderr, "Failed to load file %s\n", filename);
+    pcm_shutdown();
+    return EXIT_FAILURE;
+  }
+
+  s = pcm_sound_open(wavbuf, wavbuflen, NULL);
+  free(wavbuf);
+  if (s == NULL) {
+    fprintf(stderr, "Failed to open sample.\n");
+    pcm_shutdown();
+    return EXIT_FAILURE;
+  }
+
+  // Every voice has to be mixed for the voice seconds figure to mean
+  // anything, so raise the budget and refuse counts the mixer can't hold.
+  if (nvoices > PCM_MAX_VOICES) {
+    fprintf(stderr, "Rendering %u voices, the most the mixer can play at once\n", PCM_MAX_VOICES);
+    nvoices = PCM_MAX_VOICES;
+  }
+  if (nvoices > 0 && pcm_set_max_voices(nvoices) != NOERROR) {
+    fprintf(stderr, "Failed to set the voice budget to %u\n", nvoices);
+    pcm_sound_close(s);
+    pcm_shutdown();
+    return EXIT_FAILURE;
+  }
+
+  pcm_set_looping(s, true);
+  for (i = 0; i < nvoices; i++) {
+    if (pcm_play(s) == NOERROR)
+      continue;
+
+    // Nothing drains the command ring until the render starts, so apply
+    // what is queued and try again before giving up.
+    _pcm_mixer_lock();
+    _pcm_commands_apply();
+    _pcm_mixer_unlock();
+
+    if (pcm_play(s) != NOERROR) {
+      fprintf(stderr, "Failed to start voice %u of %u\n", i + 1, nvoices);
+      pcm_sound_close(s);
+      pcm_shutdown();
+      return EXIT_FAILURE;
+    }
+  }
+
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&start);
+  if (pcm_render_wav(outname, seconds * PCM_MIXER_RATE) != NOERROR) {
+    fprintf(stderr, "Failed to render %s\n", outname ? outname : "(null)");
+  }
+  QueryPerformanceCounter(&end);
+
+  wall = (double)(end.QuadPart - start.QuadPart) / (double)freq.QuadPart;
+  printf("%u voices, %u seconds rendered in %.3f seconds\n", nvoices, seconds, wall);
+  printf("%.1fx real time, %.1f voice seconds per second\n", seconds / wall, nvoices * seconds / wall);
+
+  pcm_sound_close(s);
+  pcm_shutdown();
+
+  return EXIT_SUCCESS;
+}
+
 int main(int argc, char* argv[]) {
   unsigned char* filename;
   unsigned char* wavbuf = NULL;
@@ -798,9 +3735,19 @@ int main(int argc, char* argv[]) {
 
   if (argc <= 1) {
     printf("Usage: %s <filename>\n", argv[0]);
+    printf("       %s -render <filename> <voices> <seconds> [out.wav]\n", argv[0]);
     return 0;
   }
 
+  if (strcmp(argv[1], "-render") == 0) {
+    if (argc < 5) {
+      printf("Usage: %s -render <filename> <voices> <seconds> [out.wav]\n", argv[0]);
+      return 0;
+    }
+
+    return standalone_render((unsigned char*)argv[2], atoi(argv[3]), atoi(argv[4]), argc > 5 ? argv[5] : NULL);
+  }
+
   SDL_Init(SDL_INIT_AUDIO);
 
   n = SDL_GetNumAudioDevices(0);
@@ -814,6 +3761,7 @@ int main(int argc, char* argv[]) {
   }
 
   pcm_init();
+  pcm_set_dispatch(PCM_DISPATCH_THREAD);
 
   printf("loading\n");
 
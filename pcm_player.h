@@ -46,13 +46,198 @@ extern "C" {
 
 typedef void (*pcm_notify_cb)(void* data);
 
+/*
+ * Identifies one playing instance of a sound. A sound handle may have many
+ * voices playing at once, each with its own position and volume. A voice
+ * slot is reused with a new serial number, so the id of a finished voice
+ * does not reach a later voice until the slot's serial wraps, after 16M
+ * more plays on that slot.
+ */
+typedef unsigned int PCM_VOICE;
+
+#define PCM_INVALID_VOICE 0
+
+/*
+ * How voices are converted to the mixer rate. Linear interpolation is the
+ * default. The windowed sinc filter costs more per voice but keeps 11025 Hz
+ * DMX lumps free of imaging. When a voice reads the source faster than the
+ * mixer rate, from a pitch above normal or a source rate above 44100 Hz, the
+ * cutoff drops to match, so it stays band limited up to 4 source frames per
+ * output frame and aliases past that.
+ */
+#define PCM_RESAMPLE_LINEAR	0
+#define PCM_RESAMPLE_SINC	1
+
+/*
+ * Output backends for pcm_init_ex(). PCM_BACKEND_DEVICE plays through the
+ * default audio device, which is what pcm_init() opens.
+ *
+ * PCM_BACKEND_NULL opens no device. The mix only advances when
+ * pcm_render_wav() or pcm_mix_render() is called and runs as fast as the
+ * CPU allows, for benchmarks, for comparing mixer output with a known good
+ * render on machines without audio hardware, and for hosts that drive the
+ * audio themselves.
+ */
+#define PCM_BACKEND_DEVICE	0
+#define PCM_BACKEND_NULL	1
+
 DJ_RESULT pcm_init();
+DJ_RESULT pcm_init_ex(unsigned int backend);
 void pcm_shutdown();
 
+/*
+ * Device period, the frames the device asks the mixer for at a time. Short
+ * periods cut latency but give the mixer less time to finish each one.
+ * pcm_set_latency() takes a power of two between PCM_PERIOD_MIN and
+ * PCM_PERIOD_MAX, 512 by default. Called before pcm_init() it picks the
+ * period to open with, called later it reopens the device, which leaves a
+ * short gap in the output. Once the device is lost it fails with ERROR.
+ *
+ * PCM_LATENCY_ADAPTIVE lets the mixer choose. It doubles the period as soon
+ * as a callback runs late or over budget and halves it again after a few
+ * seconds of callbacks with time to spare. The audio thread cannot reopen
+ * its own device, so a small thread started with the first adaptive period
+ * does it.
+ *
+ * pcm_get_latency() reports the period in use, the measured time between
+ * callbacks and the resulting output latency, two periods plus the
+ * limiter's look-ahead. If the device will not reopen at either the new or
+ * the old period, lost is set and the mixer carries on as PCM_BACKEND_NULL
+ * with no output, rather than with no device at all.
+ */
+#define PCM_LATENCY_ADAPTIVE	0
+#define PCM_PERIOD_MIN			128
+#define PCM_PERIOD_MAX			8192
+
+struct pcm_latency_info {
+  unsigned int adaptive;
+  unsigned int period;     // frames
+  unsigned int period_us;  // measured between the last two callbacks
+  unsigned int latency_us;
+  unsigned int resizes;    // times the device was reopened
+  unsigned int lost;       // the device could not be reopened
+};
+
+DJ_RESULT pcm_set_latency(unsigned int frames);
+DJ_RESULT pcm_get_latency(struct pcm_latency_info* info);
+
+/*
+ * Mixes the next frames of output and writes them to a 16 bit WAV file at
+ * the mixer rate. A NULL filename mixes and discards the output. Only valid
+ * with PCM_BACKEND_NULL. Returns INVALID_PARAM if the data would not fit in
+ * a WAV file's 4 GB.
+ */
+DJ_RESULT pcm_render_wav(const char* filename, unsigned int frames);
+
+/*
+ * Mixes the next frames of output straight into out as interleaved stereo
+ * floats in [-1, 1) at the mixer rate, 44100 Hz. out must hold frames * 2
+ * values. For hosts that own the audio thread, or that render in lockstep
+ * with their own simulation. Only valid with PCM_BACKEND_NULL. Calls from
+ * several threads are serialized. Settings, limiter gains and the like
+ * change on block boundaries, which start at every call, so a host that
+ * needs repeatable output should render the same frame counts each time.
+ */
+DJ_RESULT pcm_mix_render(float* out, unsigned int frames);
+
+DJ_RESULT pcm_set_resample_mode(unsigned int mode);
+
+/*
+ * Flags for pcm_sound_open_ex().
+ *
+ * PCM_OPEN_COPY copies the sample data out of buf, which may be freed as soon
+ * as the call returns. This is what pcm_sound_open() does.
+ *
+ * PCM_OPEN_NOCOPY plays the samples straight out of buf, for example a lump
+ * in a memory mapped WAD. The caller must keep buf valid and unmodified until
+ * pcm_sound_close() returns for the handle (or pcm_shutdown() returns).
+ *
+ * PCM_OPEN_NATIVE converts the samples once to the mixer's own format, s16 at
+ * the device rate, trading memory for CPU. An 8 bit 11025 Hz sound takes 8x
+ * the memory at 44100 Hz but plays without any per block conversion or
+ * resampling. The converted data is always a private copy, PCM_OPEN_NOCOPY
+ * has no effect with it. Without this flag samples keep their original
+ * format and are converted as they play.
+ *
+ * PCM_OPEN_ADPCM compresses the samples to 4 bit IMA ADPCM, half the size of
+ * 8 bit data and a quarter of 16 bit, trading CPU and some quality for
+ * memory. Voices decode only the blocks of a few hundred frames they are
+ * about to mix. With PCM_OPEN_NATIVE the samples are converted first and
+ * then compressed. The compressed data is always a private copy.
+ *
+ * PCM_OPEN_BUS(bus) opens the sound on bus rather than PCM_BUS_SFX, with the
+ * bus's storage flags (see pcm_bus_set_storage()) added to flags.
+ */
+#define PCM_OPEN_COPY	0x0000
+#define PCM_OPEN_NOCOPY	0x0001
+#define PCM_OPEN_NATIVE	0x0002
+#define PCM_OPEN_ADPCM	0x0004
+
+#define PCM_OPEN_BUS(bus)	(((bus) + 1) << 8)
+
 DJ_HANDLE pcm_sound_open(unsigned char* buf, unsigned int len, pcm_notify_cb callback);
+DJ_HANDLE pcm_sound_open_ex(unsigned char* buf, unsigned int len, pcm_notify_cb callback, unsigned int flags);
 void pcm_sound_close(DJ_HANDLE h);
 
+/*
+ * Opens a sound that plays straight from a file, an 8 or 16 bit mono or
+ * stereo PCM WAV or a DMX sound lump, for music, ambience and speech too
+ * long to keep in memory. A background thread reads ahead of the mixer into
+ * a ring of a few hundred KB whatever the length of the file. Only one voice
+ * can play a stream at a time, playing it again fails until the last voice
+ * has finished, and every play starts from the beginning of the file. The
+ * play call never waits for the disk. The voice starts once the background
+ * thread has read the start of the file, and a play scheduled
+ * for a frame that passes in the meantime joins in where it would have
+ * been by then. If the disk falls behind the mixer the missing frames play
+ * as silence.
+ */
+DJ_HANDLE pcm_sound_open_stream(const char* filename, pcm_notify_cb callback);
+
+/*
+ * Play, stop, pause, resume, volume and looping calls never wait on the
+ * audio thread. They queue a command that is applied at the start of the
+ * next mixed block, so pcm_is_paused() and friends report the change once
+ * that block has started. A voice that has been started counts as playing
+ * straight away. These calls return ERROR if the command queue is full.
+ */
 DJ_RESULT pcm_play(DJ_HANDLE h);
+PCM_VOICE pcm_play_voice(DJ_HANDLE h);
+
+/*
+ * At most pcm_set_max_voices() voices are mixed at once, 64 unless changed,
+ * up to 256. When a play would go over the budget the least important voice
+ * is stopped with a PCM_EVENT_STOLEN event, which may be the new voice
+ * itself. Voices are ranked by priority, then by how much they have left to
+ * play, then by volume. pcm_play() and pcm_play_voice() use
+ * PCM_PRIORITY_NORMAL.
+ */
+#define PCM_PRIORITY_LOW	0
+#define PCM_PRIORITY_NORMAL	128
+#define PCM_PRIORITY_HIGH	255
+
+PCM_VOICE pcm_play_voice_ex(DJ_HANDLE h, unsigned int priority);
+DJ_RESULT pcm_set_max_voices(unsigned int count);
+
+/*
+ * Sample accurate starts. Frames count mixer output frames since pcm_init()
+ * and pcm_mixer_frame() returns the first frame of the next block to be
+ * mixed. A voice started for a frame begins exactly on it and counts as
+ * playing, and against the voice budget, from the call on. If the frame has
+ * already gone by when the mixer sees the voice, it starts part way in as if
+ * it had started on time, so voices scheduled for the same frame stay in
+ * phase. Frame 0 starts on the next block.
+ *
+ * pcm_play_group() starts one voice for each of count handles on the same
+ * frame. The group is queued as a single command so its voices never land
+ * in different blocks, and either all of them start or none do. When the
+ * voice budget is full the group only starts if its least important voice
+ * beats enough playing voices to make room for all of it, and is stolen as
+ * a whole otherwise. The voice ids are stored in out if it is not NULL.
+ */
+unsigned long long pcm_mixer_frame();
+DJ_RESULT pcm_play_at(DJ_HANDLE h, unsigned long long frame);
+DJ_RESULT pcm_play_group(const DJ_HANDLE* handles, unsigned int count, unsigned long long frame, PCM_VOICE* out);
 DJ_RESULT pcm_stop(DJ_HANDLE h);
 
 DJ_RESULT pcm_pause(DJ_HANDLE h);
@@ -67,6 +252,218 @@ boolean pcm_is_paused(DJ_HANDLE h);
 boolean pcm_is_stopped(DJ_HANDLE h);
 boolean pcm_is_looping(DJ_HANDLE h);
 
+DJ_RESULT pcm_voice_stop(PCM_VOICE voice);
+DJ_RESULT pcm_voice_set_volume(PCM_VOICE voice, unsigned int left, unsigned int right);
+boolean pcm_voice_is_playing(PCM_VOICE voice);
+
+/*
+ * Playback rate of a voice, 16.16 fixed point, changing pitch and speed
+ * together. PCM_PITCH_NORMAL plays the sample at its own rate. The mixer
+ * steps through the shared sample data at the new rate, so pitched voices
+ * cost no extra memory.
+ */
+#define PCM_PITCH_MIN		0x01000 // 1/16
+#define PCM_PITCH_NORMAL	0x10000
+#define PCM_PITCH_MAX		0x40000 // x4
+
+DJ_RESULT pcm_voice_set_pitch(PCM_VOICE voice, unsigned int rate);
+
+/*
+ * A playing voice whose volume, after the sound's volume is applied, is too
+ * low to hear goes virtual. It keeps its place in the sample, still counts
+ * as playing and ends on time, but is not mixed until it is audible again.
+ */
+boolean pcm_voice_is_virtual(PCM_VOICE voice);
+
+/*
+ * Voice positions relative to the listener, x to the right and y straight
+ * ahead, in the same units as the distance model. A voice plays at full
+ * volume inside near_dist, fades out linearly to silence at far_dist and is
+ * panned by how far it lies to one side. The default model is 160 and 1200
+ * map units. A voice that has never been positioned sits on the listener
+ * and is not panned or attenuated.
+ *
+ * pcm_voice_set_positions() updates count voices in one call, with the ids
+ * and coordinates in separate arrays, and is meant to be called once per
+ * game frame as the listener moves. The mixer picks the new positions up at
+ * the start of its next block and computes every voice's gains in a single
+ * SIMD pass. Ids of voices that have stopped are ignored.
+ */
+DJ_RESULT pcm_voice_set_position(PCM_VOICE voice, float x, float y);
+DJ_RESULT pcm_voice_set_positions(const PCM_VOICE* voices, const float* x, const float* y, unsigned int count);
+DJ_RESULT pcm_set_distance_model(float near_dist, float far_dist);
+
+/*
+ * Per voice filters for occlusion, underwater and the like. A low-pass or
+ * high-pass filter is a 12 dB/octave Butterworth biquad at cutoff Hz, run on
+ * the voice after its gain and panning. PCM_FILTER_NONE takes the filter off
+ * and voices start without one.
+ *
+ * pcm_voice_set_filters() changes count voices in one call, the way
+ * pcm_voice_set_positions() moves them. The mixer picks the settings up at
+ * the start of its next block and works out the coefficients of every voice
+ * that changed in one pass. Filtered voices are then run through the
+ * filters several at a time, one voice per SIMD lane. Changing only the
+ * cutoff keeps the filter's state, so a cutoff swept from block to block
+ * does not click. Ids of voices that have stopped are ignored.
+ */
+#define PCM_FILTER_NONE		0
+#define PCM_FILTER_LOWPASS	1
+#define PCM_FILTER_HIGHPASS	2
+
+DJ_RESULT pcm_voice_set_filter(PCM_VOICE voice, unsigned int type, unsigned int cutoff);
+DJ_RESULT pcm_voice_set_filters(const PCM_VOICE* voices, const unsigned int* types, const unsigned int* cutoffs, unsigned int count);
+
+/*
+ * Submix buses. Every sound plays through one bus, PCM_BUS_SFX until
+ * pcm_set_bus() moves it, and the bus volume (16.16 fixed point, 65536 is
+ * unity) and mute apply on top of the sound and voice volumes. The mixer
+ * combines a bus's settings once per block, so changing the volume of a
+ * whole category is one call however many sounds play through it.
+ *
+ * pcm_bus_set_ducking() makes a bus duck under another one, its sidechain.
+ * While anything on the sidechain is being mixed the bus fades down to depth
+ * (16.16) over attack_ms, and back up over release_ms once the sidechain has
+ * gone quiet. PCM_BUS_NONE turns ducking off. By default the music bus ducks
+ * 12 dB under the voice bus, with a 50 ms attack and a 500 ms release.
+ */
+#define PCM_BUS_SFX		0
+#define PCM_BUS_UI		1
+#define PCM_BUS_MUSIC	2
+#define PCM_BUS_VOICE	3
+#define PCM_BUSES		4
+#define PCM_BUS_NONE	0xffffffff
+
+DJ_RESULT pcm_set_bus(DJ_HANDLE h, unsigned int bus);
+unsigned int pcm_get_bus(DJ_HANDLE h);
+DJ_RESULT pcm_bus_set_volume(unsigned int bus, unsigned int level);
+DJ_RESULT pcm_bus_set_mute(unsigned int bus, boolean mute);
+DJ_RESULT pcm_bus_set_ducking(unsigned int bus, unsigned int sidechain, unsigned int depth, unsigned int attack_ms, unsigned int release_ms);
+
+/*
+ * Storage flags, PCM_OPEN_NATIVE and PCM_OPEN_ADPCM, for sounds opened on a
+ * bus with PCM_OPEN_BUS(). For example compressing the music and voice buses
+ * keeps long sounds small while effects stay cheap to mix. Sounds already
+ * open are left as they are. None by default.
+ */
+DJ_RESULT pcm_bus_set_storage(unsigned int bus, unsigned int flags);
+
+/*
+ * Protection on the final mix, both on by default. PCM_MASTER_LIMITER is a
+ * look-ahead peak limiter that turns the whole mix down ahead of a peak
+ * instead of letting it clip. It delays the output by 64 frames. Switching
+ * it off drops the frames it holds back. PCM_MASTER_SOFTCLIP leaves the mix
+ * alone up to 0.8x full scale and rounds off anything louder so it never
+ * hits the hard limit. With both on the limiter only steps in above 1.4x
+ * full scale and leaves the rest to the soft clipper.
+ */
+#define PCM_MASTER_LIMITER	0x0001
+#define PCM_MASTER_SOFTCLIP	0x0002
+
+DJ_RESULT pcm_set_master(unsigned int flags);
+
+/*
+ * Helper threads for scenes with very many voices, none by default.
+ * pcm_set_mix_threads() starts that many helpers, replacing any running ones,
+ * or stops them all with 0. In a block with at least threshold audible
+ * voices the playing voices are split evenly between the helpers and the
+ * audio thread, each summing its share into its own buffer, and the audio
+ * thread adds the buffers together. Smaller blocks are mixed by the audio
+ * thread alone since waking the helpers would cost more than it saves. A
+ * threshold of 0 picks PCM_DEFAULT_MIX_THRESHOLD. The output is the same
+ * either way.
+ */
+#define PCM_MAX_MIX_THREADS			7
+#define PCM_DEFAULT_MIX_THRESHOLD	48
+
+DJ_RESULT pcm_set_mix_threads(unsigned int threads, unsigned int threshold);
+
+/*
+ * Completion events. The audio thread never calls user code. When a voice
+ * plays to the end it queues a PCM_EVENT_DONE event, or PCM_EVENT_STOLEN if
+ * the voice budget cut it off, which the application collects with
+ * pcm_poll_events(), from one thread at a time. Events are dropped if the
+ * queue is allowed to fill up.
+ *
+ * frame is the mixer frame the voice fell silent on, the first one after its
+ * last sample, counted like pcm_play_at() frames. It is exact however late
+ * the event is collected, so sounds chained with pcm_play_at() on frames
+ * worked out from it stay in time. One started for evt.frame itself is
+ * already late by the time the event is seen and starts part way in, as if
+ * it had started on time.
+ */
+#define PCM_EVENT_DONE		1
+#define PCM_EVENT_STOLEN	2
+
+struct pcm_event {
+  unsigned int type;
+  DJ_HANDLE handle; // the sound, it may have been closed since
+  PCM_VOICE voice;
+  unsigned long long frame;
+};
+
+/*
+ * Copies up to max queued events into events and returns how many were
+ * copied.
+ */
+unsigned int pcm_poll_events(struct pcm_event* events, unsigned int max);
+
+/*
+ * Drains the queue on the calling thread, calling the pcm_notify_cb passed
+ * to pcm_sound_open() for each event. Returns the number of events.
+ */
+unsigned int pcm_dispatch_events();
+
+/*
+ * Returns a Win32 auto-reset event that is signaled after a mixed block
+ * queued at least one event, for use with WaitForSingleObject() in
+ * PCM_DISPATCH_NONE mode.
+ */
+DJ_HANDLE pcm_event_handle();
+
+/*
+ * PCM_DISPATCH_NONE leaves the queue to the application. This is the
+ * default.
+ *
+ * PCM_DISPATCH_THREAD starts a dispatcher thread that waits for events and
+ * calls each sound's pcm_notify_cb. Do not poll the queue in this mode.
+ */
+#define PCM_DISPATCH_NONE	0
+#define PCM_DISPATCH_THREAD	1
+
+DJ_RESULT pcm_set_dispatch(unsigned int mode);
+
+/*
+ * Mixer callback telemetry. Collection is off by default and costs one
+ * branch per block while off. Times are in microseconds and the budget is
+ * the time the device takes to play one block.
+ */
+#define PCM_STATS_BUCKETS	11
+
+struct pcm_stats {
+  unsigned long long blocks;
+  unsigned long long overruns;     // blocks that took longer than their budget
+  unsigned long long underruns;    // estimated, the callback came late enough that the device ran dry
+  unsigned long long voices_mixed; // summed over all blocks
+  unsigned long long total_us;
+
+  unsigned int max_voices;
+  unsigned int budget_us;
+  unsigned int last_us;
+  unsigned int max_us;
+
+  // Blocks by the share of the budget they used, in tenths. The last bucket
+  // counts everything at or over budget.
+  unsigned int histogram[PCM_STATS_BUCKETS];
+};
+
+/*
+ * Enabling collection clears the counters.
+ */
+DJ_RESULT pcm_enable_stats(boolean enable);
+void pcm_reset_stats();
+DJ_RESULT pcm_get_stats(struct pcm_stats* stats);
+
 #ifdef __cplusplus
 }
 #endif
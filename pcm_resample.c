@@ -0,0 +1,227 @@
+/*
+ * DjMM
+ * v0.1
+ *
+ * Copyright (c) 2011, David J. Rager
+ * djrager@fourthwoods.com
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * pcm_resample.c
+ *
+ *  Created on: Oct 16, 2026
+ *      Author: David J. Rager
+ *       Email: djrager@fourthwoods.com
+ */
+#include <math.h>
+#include <string.h>
+
+#include "pcm_player.h"
+#include "pcm_resample.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// Coefficients are Q14 so the centre tap of phase 0 still fits in a short.
+#define SINC_SHIFT	14
+#define SINC_ONE	(1 << SINC_SHIFT)
+
+// Cutoff as a fraction of the source Nyquist frequency. Slightly below 1 to
+// leave room for the transition band of a 16 tap filter.
+#define SINC_CUTOFF	0.9
+
+// Decimating needs the cutoff lowered to the output Nyquist frequency, so
+// there is one table per quarter octave of step up to 4 source frames per
+// output frame. Past that the last table is used and the output aliases.
+#define SINC_TABLES	9
+
+/*
+ * Blackman windowed sinc, one row per fractional phase. Row p holds the taps
+ * for a read position p / PCM_SINC_PHASES past the integer frame, starting
+ * PCM_RESAMPLE_HISTORY frames before it. Table n is for steps up to
+ * sinc_step[n].
+ */
+static short sinc_table[SINC_TABLES][PCM_SINC_PHASES][PCM_SINC_TAPS];
+static unsigned int sinc_step[SINC_TABLES];
+static int sinc_ready = 0;
+
+static short clamp_s16(int v) {
+  if (v > 32767)
+    return 32767;
+  if (v < -32768)
+    return -32768;
+  return (short)v;
+}
+
+static void _sinc_build(short table[PCM_SINC_PHASES][PCM_SINC_TAPS], double cutoff) {
+  unsigned int p, k;
+  const double half = PCM_SINC_TAPS / 2.0;
+
+  for (p = 0; p < PCM_SINC_PHASES; p++) {
+    double t = (double)p / PCM_SINC_PHASES;
+    double h[PCM_SINC_TAPS];
+    double sum = 0.0;
+    int total = 0, peak = 0;
+
+    for (k = 0; k < PCM_SINC_TAPS; k++) {
+      double x = (double)k - PCM_RESAMPLE_HISTORY - t;
+      double s = (x == 0.0) ? 1.0 : sin(M_PI * cutoff * x) / (M_PI * cutoff * x);
+      double w = 0.42 + 0.5 * cos(M_PI * x / half) + 0.08 * cos(2.0 * M_PI * x / half);
+
+      if (fabs(x) >= half)
+        w = 0.0;
+
+      h[k] = s * w;
+      sum += h[k];
+    }
+
+    // Normalize each phase to unity gain so a DC input stays flat, putting
+    // the rounding error on the largest tap.
+    for (k = 0; k < PCM_SINC_TAPS; k++) {
+      table[p][k] = (short)floor(h[k] / sum * SINC_ONE + 0.5);
+      total += table[p][k];
+      if (table[p][k] > table[p][peak])
+        peak = k;
+    }
+    table[p][peak] += (short)(SINC_ONE - total);
+  }
+}
+
+void pcm_resample_init() {
+  unsigned int n;
+
+  if (sinc_ready)
+    return;
+
+  for (n = 0; n < SINC_TABLES; n++) {
+    double ratio = pow(2.0, n / 4.0);
+
+    sinc_step[n] = (unsigned int)floor(ratio * 0x10000);
+    _sinc_build(sinc_table[n], SINC_CUTOFF / ratio);
+  }
+
+  sinc_ready = 1;
+}
+
+static void _resample_copy(short* out, const short* in, unsigned int channels, unsigned int frames) {
+  unsigned int i;
+
+  if (channels == 2) {
+    memcpy(out, in, frames * 2 * sizeof(short));
+    return;
+  }
+
+  for (i = 0; i < frames; i++) {
+    out[0] = in[i];
+    out[1] = in[i];
+    out += 2;
+  }
+}
+
+static void _resample_linear(short* out, const short* in, unsigned int channels, unsigned int frames, unsigned int pos, unsigned int step) {
+  unsigned int i;
+
+  if (channels == 1) {
+    for (i = 0; i < frames; i++) {
+      const short* f = in + (pos >> 16);
+      int t = (pos & 0xffff) >> 1;
+      short v = (short)(f[0] + (((f[1] - f[0]) * t) >> 15));
+      out[0] = v;
+      out[1] = v;
+      out += 2;
+      pos += step;
+    }
+  } else {
+    for (i = 0; i < frames; i++) {
+      const short* f = in + (pos >> 16) * 2;
+      int t = (pos & 0xffff) >> 1;
+      out[0] = (short)(f[0] + (((f[2] - f[0]) * t) >> 15));
+      out[1] = (short)(f[1] + (((f[3] - f[1]) * t) >> 15));
+      out += 2;
+      pos += step;
+    }
+  }
+}
+
+static void _resample_sinc(short* out, const short* in, unsigned int channels, unsigned int frames, unsigned int pos, unsigned int step) {
+  short (*table)[PCM_SINC_TAPS];
+  unsigned int i, k, n;
+
+  // The least filtered table that still cuts off below the output Nyquist.
+  n = 0;
+  while (n < SINC_TABLES - 1 && step > sinc_step[n])
+    n++;
+  table = sinc_table[n];
+
+  in -= PCM_RESAMPLE_HISTORY * channels;
+
+  if (channels == 1) {
+    for (i = 0; i < frames; i++) {
+      const short* f = in + (pos >> 16);
+      const short* c = table[(pos >> 8) & (PCM_SINC_PHASES - 1)];
+      int acc = 0;
+      short v;
+
+      for (k = 0; k < PCM_SINC_TAPS; k++)
+        acc += f[k] * c[k];
+
+      v = clamp_s16(acc >> SINC_SHIFT);
+      out[0] = v;
+      out[1] = v;
+      out += 2;
+      pos += step;
+    }
+  } else {
+    for (i = 0; i < frames; i++) {
+      const short* f = in + (pos >> 16) * 2;
+      const short* c = table[(pos >> 8) & (PCM_SINC_PHASES - 1)];
+      int l = 0, r = 0;
+
+      for (k = 0; k < PCM_SINC_TAPS; k++) {
+        l += f[k * 2] * c[k];
+        r += f[k * 2 + 1] * c[k];
+      }
+
+      out[0] = clamp_s16(l >> SINC_SHIFT);
+      out[1] = clamp_s16(r >> SINC_SHIFT);
+      out += 2;
+      pos += step;
+    }
+  }
+}
+
+void pcm_resample(short* out, const short* in, unsigned int channels, unsigned int frames, unsigned int frac, unsigned int step, unsigned int mode) {
+  // Source already at the mixer rate and frame aligned, nothing to filter.
+  if (step == 0x10000 && frac == 0) {
+    _resample_copy(out, in, channels, frames);
+    return;
+  }
+
+  switch (mode) {
+  case PCM_RESAMPLE_SINC:
+    _resample_sinc(out, in, channels, frames, frac, step);
+    break;
+  case PCM_RESAMPLE_LINEAR:
+  default:
+    _resample_linear(out, in, channels, frames, frac, step);
+    break;
+  }
+}
@@ -0,0 +1,71 @@
+/*
+ * DjMM
+ * v0.1
+ *
+ * Copyright (c) 2011, David J. Rager
+ * djrager@fourthwoods.com
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * pcm_resample.h
+ *
+ *  Created on: Oct 16, 2026
+ *      Author: David J. Rager
+ *       Email: djrager@fourthwoods.com
+ */
+
+#ifndef PCM_RESAMPLE_H_
+#define PCM_RESAMPLE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PCM_SINC_TAPS		16
+#define PCM_SINC_PHASES		256
+
+/*
+ * Number of source frames the resampler reads before and after the frames
+ * a block actually steps over. The caller must have them in the input buffer.
+ */
+#define PCM_RESAMPLE_HISTORY	(PCM_SINC_TAPS / 2 - 1)
+#define PCM_RESAMPLE_LOOKAHEAD	(PCM_SINC_TAPS / 2)
+
+/*
+ * Builds the polyphase filter tables. Must be called before the first call
+ * to pcm_resample() and may be called more than once.
+ */
+void pcm_resample_init();
+
+/*
+ * Converts s16 source frames to s16 stereo output frames. in points to the
+ * source frame at the integer read position, frac and step are the 16.16
+ * fractional position and the source frames per output frame. Mono input is
+ * written to both output channels.
+ *
+ * mode is PCM_RESAMPLE_LINEAR or PCM_RESAMPLE_SINC from pcm_player.h.
+ */
+void pcm_resample(short* out, const short* in, unsigned int channels, unsigned int frames, unsigned int frac, unsigned int step, unsigned int mode);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PCM_RESAMPLE_H_ */
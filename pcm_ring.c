@@ -0,0 +1,96 @@
+/*
+ * DjMM
+ * v0.1
+ *
+ * Copyright (c) 2011, David J. Rager
+ * djrager@fourthwoods.com
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * pcm_ring.c
+ *
+ *  Created on: Oct 16, 2026
+ *      Author: David J. Rager
+ *       Email: djrager@fourthwoods.com
+ */
+#include "pcm_ring.h"
+
+#define RING_MASK	(PCM_RING_SIZE - 1)
+
+/*
+ * Each cell carries a sequence number. A cell at position pos is free for a
+ * producer while seq == pos, holds a command for the consumer once
+ * seq == pos + 1, and becomes free again for position pos + PCM_RING_SIZE
+ * after it is popped. Positions are compared as differences so they may wrap.
+ */
+
+void pcm_ring_init(struct pcm_ring* r) {
+  LONG i;
+
+  for (i = 0; i < PCM_RING_SIZE; i++)
+    r->cells[i].seq = i;
+
+  r->head = 0;
+  r->tail = 0;
+}
+
+int pcm_ring_push(struct pcm_ring* r, const struct pcm_command* cmd) {
+  struct pcm_ring_cell* c;
+  LONG pos = r->head;
+  LONG diff;
+
+  for (;;) {
+    c = &r->cells[pos & RING_MASK];
+    diff = (LONG)((unsigned long)c->seq - (unsigned long)pos);
+
+    if (diff == 0) {
+      // Claim the position, another producer may have beaten us to it.
+      LONG prev = InterlockedCompareExchange(&r->head, (LONG)((unsigned long)pos + 1), pos);
+      if (prev == pos)
+        break;
+      pos = prev;
+    } else if (diff < 0) {
+      // The consumer has not freed this cell yet.
+      return 0;
+    } else {
+      pos = r->head;
+    }
+  }
+
+  c->cmd = *cmd;
+  InterlockedExchange(&c->seq, (LONG)((unsigned long)pos + 1));
+
+  return 1;
+}
+
+int pcm_ring_pop(struct pcm_ring* r, struct pcm_command* cmd) {
+  struct pcm_ring_cell* c = &r->cells[r->tail & RING_MASK];
+  LONG diff = (LONG)((unsigned long)c->seq - ((unsigned long)r->tail + 1));
+
+  // Empty, or the producer that claimed this cell has not finished writing.
+  if (diff < 0)
+    return 0;
+
+  *cmd = c->cmd;
+  InterlockedExchange(&c->seq, (LONG)((unsigned long)r->tail + PCM_RING_SIZE));
+  r->tail = (LONG)((unsigned long)r->tail + 1);
+
+  return 1;
+}
@@ -0,0 +1,89 @@
+/*
+ * DjMM
+ * v0.1
+ *
+ * Copyright (c) 2011, David J. Rager
+ * djrager@fourthwoods.com
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * pcm_ring.h
+ *
+ *  Created on: Oct 16, 2026
+ *      Author: David J. Rager
+ *       Email: djrager@fourthwoods.com
+ */
+
+#ifndef PCM_RING_H_
+#define PCM_RING_H_
+
+#include <windows.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PCM_RING_SIZE	256 // must be a power of 2
+
+/*
+ * A request from an API thread for the audio thread. The meaning of the
+ * fields depends on type, see the PCM_CMD_* values in pcm_player.c.
+ */
+struct pcm_command {
+  unsigned int type;
+  void* target;
+  unsigned int voice;
+  unsigned int a;
+  unsigned int b;
+};
+
+struct pcm_ring_cell {
+  volatile LONG seq;
+  struct pcm_command cmd;
+};
+
+/*
+ * Bounded multi-producer, single-consumer queue. Any number of threads may
+ * push at once without blocking each other. Only one thread may pop at a
+ * time.
+ */
+struct pcm_ring {
+  struct pcm_ring_cell cells[PCM_RING_SIZE];
+  volatile LONG head; // next position to push
+  LONG tail;          // next position to pop, owned by the consumer
+};
+
+void pcm_ring_init(struct pcm_ring* r);
+
+/*
+ * Queues a copy of cmd. Returns false if the ring is full.
+ */
+int pcm_ring_push(struct pcm_ring* r, const struct pcm_command* cmd);
+
+/*
+ * Takes the oldest command. Returns false if the ring is empty.
+ */
+int pcm_ring_pop(struct pcm_ring* r, struct pcm_command* cmd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PCM_RING_H_ */
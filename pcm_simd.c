@@ -0,0 +1,993 @@
+/*
+ * DjMM
+ * v0.1
+ *
+ * Copyright (c) 2011, David J. Rager
+ * djrager@fourthwoods.com
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * pcm_simd.c
+ *
+ *  Created on: Oct 16, 2026
+ *      Author: David J. Rager
+ *       Email: djrager@fourthwoods.com
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+
+#include "pcm_simd.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define PCM_SIMD_X86
+#endif
+
+#ifdef PCM_SIMD_X86
+
+#include <emmintrin.h>
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define PCM_TARGET_AVX2
+#else
+#include <cpuid.h>
+#define PCM_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+#endif
+
+/*
+ * Scalar kernels. These define the exact results the SIMD versions must
+ * reproduce.
+ */
+
+static void _widen_u8_scalar(short* out, const unsigned char* in, unsigned int len) {
+  unsigned int i;
+
+  for (i = 0; i < len; i++)
+    out[i] = (short)(((int)in[i] - 128) * 256);
+}
+
+static void _gain_s16_scalar(short* buf, unsigned int len, unsigned int lvol, unsigned int rvol) {
+  unsigned int i;
+
+  if (lvol >= 32768 && rvol >= 32768)
+    return;
+
+  // Q15 multiply, full volume on one channel only is rounded down to 32767.
+  if (lvol > 32767)
+    lvol = 32767;
+  if (rvol > 32767)
+    rvol = 32767;
+
+  for (i = 0; i + 1 < len; i += 2) {
+    buf[i] = (short)((buf[i] * (int)lvol) >> 15);
+    buf[i + 1] = (short)((buf[i + 1] * (int)rvol) >> 15);
+  }
+  if (i < len)
+    buf[i] = (short)((buf[i] * (int)lvol) >> 15);
+}
+
+static void _mix_s16_scalar(int* accum, const short* in, unsigned int len) {
+  unsigned int i;
+
+  for (i = 0; i < len; i++)
+    accum[i] += in[i];
+}
+
+static void _add_s32_scalar(int* accum, const int* in, unsigned int len) {
+  unsigned int i;
+
+  for (i = 0; i < len; i++)
+    accum[i] += in[i];
+}
+
+static void _clip_s16_scalar(short* out, const int* accum, unsigned int len) {
+  unsigned int i;
+
+  for (i = 0; i < len; i++) {
+    int v = accum[i];
+    if (v > 32767)
+      v = 32767;
+    else if (v < -32768)
+      v = -32768;
+    out[i] = (short)v;
+  }
+}
+
+static void _clip_f32_scalar(float* out, const int* accum, unsigned int len) {
+  unsigned int i;
+
+  for (i = 0; i < len; i++) {
+    int v = accum[i];
+    if (v > 32767)
+      v = 32767;
+    else if (v < -32768)
+      v = -32768;
+    out[i] = (float)v * (1.0f / 32768.0f);
+  }
+}
+
+static float _min_scalar(float a, float b) {
+  return a < b ? a : b;
+}
+
+static float _max_scalar(float a, float b) {
+  return a > b ? a : b;
+}
+
+/*
+ * Written as the exact sequence of single precision operations the SIMD
+ * versions perform, min and max included, so all of them round alike.
+ */
+static void _pan_gain_scalar(unsigned int* lgain, unsigned int* rgain, const float* x, const float* y, unsigned int len, float near_dist, float far_dist) {
+  float scale = 1.0f / (far_dist - near_dist);
+  unsigned int i;
+
+  for (i = 0; i < len; i++) {
+    float d = sqrtf(x[i] * x[i] + y[i] * y[i]);
+    float att = _min_scalar(_max_scalar((far_dist - d) * scale, 0.0f), 1.0f);
+    float pan = _min_scalar(_max_scalar(x[i] / _max_scalar(d, FLT_MIN), -1.0f), 1.0f);
+    float l = att * _min_scalar(1.0f - pan, 1.0f);
+    float r = att * _min_scalar(1.0f + pan, 1.0f);
+
+    lgain[i] = (unsigned int)(int)(l * 65536.0f + 0.5f);
+    rgain[i] = (unsigned int)(int)(r * 65536.0f + 0.5f);
+  }
+}
+
+static int _peak_s32_scalar(const int* buf, unsigned int len) {
+  int peak = 0;
+  unsigned int i;
+
+  for (i = 0; i < len; i++) {
+    int v = buf[i] < 0 ? -buf[i] : buf[i];
+    if (v > peak)
+      peak = v;
+  }
+
+  return peak;
+}
+
+// Frames are numbered from first so the SIMD tails stay on the same ramp.
+static void _ramp_s32_scalar_at(int* buf, unsigned int len, float gain, float step, unsigned int first) {
+  unsigned int i;
+
+  for (i = 0; i < len; i++) {
+    float g = gain + step * (float)(first + (i >> 1));
+    buf[i] = (int)((float)buf[i] * g);
+  }
+}
+
+static void _ramp_s32_scalar(int* buf, unsigned int len, float gain, float step) {
+  if (gain == 1.0f && step == 0.0f)
+    return;
+
+  _ramp_s32_scalar_at(buf, len, gain, step, 0);
+}
+
+/*
+ * Above the knee the excess a is mapped to range * a / (range + a), which
+ * starts out with unit slope and flattens out at range.
+ */
+static void _softclip_s32_scalar(int* buf, unsigned int len, int knee, int ceiling) {
+  float range = (float)(ceiling - knee);
+  unsigned int i;
+
+  for (i = 0; i < len; i++) {
+    int v = buf[i] < 0 ? -buf[i] : buf[i];
+
+    if (v > knee) {
+      float a = (float)(v - knee);
+      int m = knee + (int)(range * a / (range + a));
+      buf[i] = buf[i] < 0 ? -m : m;
+    }
+  }
+}
+
+// Bound on a filtered lane's output, keeps the conversion to int in range.
+#define BIQUAD_LIMIT	1048576.0f
+
+static void _biquad_bank_scalar(int* accum, const float* in, unsigned int frames, struct pcm_biquad_bank* bank) {
+  unsigned int i, c, k;
+
+  for (i = 0; i < frames; i++) {
+    for (c = 0; c < 2; c++) {
+      const float* x = in + (i * 2 + c) * PCM_FILTER_LANES;
+      float* z1 = bank->z1[c];
+      float* z2 = bank->z2[c];
+      int sum = 0;
+
+      for (k = 0; k < PCM_FILTER_LANES; k++) {
+        float y = bank->b0[k] * x[k] + z1[k];
+
+        z1[k] = bank->b1[k] * x[k] - bank->a1[k] * y + z2[k];
+        z2[k] = bank->b2[k] * x[k] - bank->a2[k] * y;
+        sum += (int)_min_scalar(_max_scalar(y, -BIQUAD_LIMIT), BIQUAD_LIMIT);
+      }
+
+      accum[i * 2 + c] += sum;
+    }
+  }
+}
+
+static const struct pcm_kernels scalar_kernels = {
+  "scalar",
+  _widen_u8_scalar,
+  _gain_s16_scalar,
+  _mix_s16_scalar,
+  _add_s32_scalar,
+  _clip_s16_scalar,
+  _clip_f32_scalar,
+  _pan_gain_scalar,
+  _peak_s32_scalar,
+  _ramp_s32_scalar,
+  _softclip_s32_scalar,
+  _biquad_bank_scalar
+};
+
+#ifdef PCM_SIMD_X86
+
+/*
+ * SSE2 kernels. The tails that do not fill a whole register are finished by
+ * the scalar code.
+ */
+
+static void _widen_u8_sse2(short* out, const unsigned char* in, unsigned int len) {
+  unsigned int i = 0;
+  __m128i bias = _mm_set1_epi8((char)0x80);
+  __m128i zero = _mm_setzero_si128();
+
+  // Flipping the top bit takes the bias off, then each byte goes in the high
+  // half of its s16.
+  for (; i + 16 <= len; i += 16) {
+    __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in + i)), bias);
+
+    _mm_storeu_si128((__m128i*)(out + i), _mm_unpacklo_epi8(zero, x));
+    _mm_storeu_si128((__m128i*)(out + i + 8), _mm_unpackhi_epi8(zero, x));
+  }
+
+  _widen_u8_scalar(out + i, in + i, len - i);
+}
+
+static void _gain_s16_sse2(short* buf, unsigned int len, unsigned int lvol, unsigned int rvol) {
+  unsigned int i = 0;
+  __m128i vol;
+
+  if (lvol >= 32768 && rvol >= 32768)
+    return;
+
+  if (lvol > 32767)
+    lvol = 32767;
+  if (rvol > 32767)
+    rvol = 32767;
+
+  vol = _mm_set_epi16((short)rvol, (short)lvol, (short)rvol, (short)lvol, (short)rvol, (short)lvol, (short)rvol, (short)lvol);
+
+  for (; i + 8 <= len; i += 8) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(buf + i));
+    __m128i plo = _mm_mullo_epi16(x, vol);
+    __m128i phi = _mm_mulhi_epi16(x, vol);
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(plo, phi), 15);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(plo, phi), 15);
+
+    _mm_storeu_si128((__m128i*)(buf + i), _mm_packs_epi32(lo, hi));
+  }
+
+  _gain_s16_scalar(buf + i, len - i, lvol, rvol);
+}
+
+static void _mix_s16_sse2(int* accum, const short* in, unsigned int len) {
+  unsigned int i = 0;
+
+  for (; i + 8 <= len; i += 8) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(in + i));
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+    __m128i a0 = _mm_loadu_si128((const __m128i*)(accum + i));
+    __m128i a1 = _mm_loadu_si128((const __m128i*)(accum + i + 4));
+
+    _mm_storeu_si128((__m128i*)(accum + i), _mm_add_epi32(a0, lo));
+    _mm_storeu_si128((__m128i*)(accum + i + 4), _mm_add_epi32(a1, hi));
+  }
+
+  _mix_s16_scalar(accum + i, in + i, len - i);
+}
+
+static void _add_s32_sse2(int* accum, const int* in, unsigned int len) {
+  unsigned int i = 0;
+
+  for (; i + 4 <= len; i += 4) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(accum + i));
+    __m128i x = _mm_loadu_si128((const __m128i*)(in + i));
+
+    _mm_storeu_si128((__m128i*)(accum + i), _mm_add_epi32(a, x));
+  }
+
+  _add_s32_scalar(accum + i, in + i, len - i);
+}
+
+static void _clip_s16_sse2(short* out, const int* accum, unsigned int len) {
+  unsigned int i = 0;
+
+  for (; i + 8 <= len; i += 8) {
+    __m128i a0 = _mm_loadu_si128((const __m128i*)(accum + i));
+    __m128i a1 = _mm_loadu_si128((const __m128i*)(accum + i + 4));
+
+    _mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi32(a0, a1));
+  }
+
+  _clip_s16_scalar(out + i, accum + i, len - i);
+}
+
+static void _clip_f32_sse2(float* out, const int* accum, unsigned int len) {
+  unsigned int i = 0;
+  __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+
+  // Packing to s16 and back saturates without a 32 bit min or max.
+  for (; i + 8 <= len; i += 8) {
+    __m128i a0 = _mm_loadu_si128((const __m128i*)(accum + i));
+    __m128i a1 = _mm_loadu_si128((const __m128i*)(accum + i + 4));
+    __m128i s = _mm_packs_epi32(a0, a1);
+
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16)), scale));
+    _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16)), scale));
+  }
+
+  _clip_f32_scalar(out + i, accum + i, len - i);
+}
+
+static void _pan_gain_sse2(unsigned int* lgain, unsigned int* rgain, const float* x, const float* y, unsigned int len, float near_dist, float far_dist) {
+  unsigned int i = 0;
+  __m128 scale = _mm_set1_ps(1.0f / (far_dist - near_dist));
+  __m128 far = _mm_set1_ps(far_dist);
+  __m128 zero = _mm_setzero_ps();
+  __m128 one = _mm_set1_ps(1.0f);
+  __m128 minus_one = _mm_set1_ps(-1.0f);
+  __m128 tiny = _mm_set1_ps(FLT_MIN);
+  __m128 full = _mm_set1_ps(65536.0f);
+  __m128 half = _mm_set1_ps(0.5f);
+
+  for (; i + 4 <= len; i += 4) {
+    __m128 vx = _mm_loadu_ps(x + i);
+    __m128 vy = _mm_loadu_ps(y + i);
+    __m128 d = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)));
+    __m128 att = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_sub_ps(far, d), scale), zero), one);
+    __m128 pan = _mm_min_ps(_mm_max_ps(_mm_div_ps(vx, _mm_max_ps(d, tiny)), minus_one), one);
+    __m128 l = _mm_mul_ps(att, _mm_min_ps(_mm_sub_ps(one, pan), one));
+    __m128 r = _mm_mul_ps(att, _mm_min_ps(_mm_add_ps(one, pan), one));
+
+    _mm_storeu_si128((__m128i*)(lgain + i), _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(l, full), half)));
+    _mm_storeu_si128((__m128i*)(rgain + i), _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(r, full), half)));
+  }
+
+  _pan_gain_scalar(lgain + i, rgain + i, x + i, y + i, len - i, near_dist, far_dist);
+}
+
+// SSE2 has no 32 bit abs or max, they are built from shifts and compares.
+static __m128i _abs_epi32_sse2(__m128i x) {
+  __m128i sign = _mm_srai_epi32(x, 31);
+  return _mm_sub_epi32(_mm_xor_si128(x, sign), sign);
+}
+
+static __m128i _max_epi32_sse2(__m128i a, __m128i b) {
+  __m128i gt = _mm_cmpgt_epi32(a, b);
+  return _mm_or_si128(_mm_and_si128(gt, a), _mm_andnot_si128(gt, b));
+}
+
+static int _peak_s32_sse2(const int* buf, unsigned int len) {
+  unsigned int i = 0;
+  __m128i peak = _mm_setzero_si128();
+  int lanes[4];
+  int tail;
+
+  for (; i + 4 <= len; i += 4)
+    peak = _max_epi32_sse2(peak, _abs_epi32_sse2(_mm_loadu_si128((const __m128i*)(buf + i))));
+
+  _mm_storeu_si128((__m128i*)lanes, peak);
+  tail = _peak_s32_scalar(buf + i, len - i);
+  tail = tail > lanes[0] ? tail : lanes[0];
+  tail = tail > lanes[1] ? tail : lanes[1];
+  tail = tail > lanes[2] ? tail : lanes[2];
+  return tail > lanes[3] ? tail : lanes[3];
+}
+
+static void _ramp_s32_sse2_at(int* buf, unsigned int len, float gain, float step, unsigned int first) {
+  unsigned int i = 0;
+  __m128 vgain = _mm_set1_ps(gain);
+  __m128 vstep = _mm_set1_ps(step);
+  __m128 frame = _mm_set_ps((float)(first + 1), (float)(first + 1), (float)first, (float)first);
+  __m128 two = _mm_set1_ps(2.0f);
+
+  for (; i + 4 <= len; i += 4) {
+    __m128 x = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(buf + i)));
+    __m128 g = _mm_add_ps(vgain, _mm_mul_ps(vstep, frame));
+
+    _mm_storeu_si128((__m128i*)(buf + i), _mm_cvttps_epi32(_mm_mul_ps(x, g)));
+    frame = _mm_add_ps(frame, two);
+  }
+
+  _ramp_s32_scalar_at(buf + i, len - i, gain, step, first + (i >> 1));
+}
+
+static void _ramp_s32_sse2(int* buf, unsigned int len, float gain, float step) {
+  if (gain == 1.0f && step == 0.0f)
+    return;
+
+  _ramp_s32_sse2_at(buf, len, gain, step, 0);
+}
+
+static void _softclip_s32_sse2(int* buf, unsigned int len, int knee, int ceiling) {
+  unsigned int i = 0;
+  __m128i vknee = _mm_set1_epi32(knee);
+  __m128 zero = _mm_setzero_ps();
+  __m128 range = _mm_set1_ps((float)(ceiling - knee));
+
+  for (; i + 4 <= len; i += 4) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(buf + i));
+    __m128i sign = _mm_srai_epi32(x, 31);
+    __m128i v = _mm_sub_epi32(_mm_xor_si128(x, sign), sign);
+    __m128i over = _mm_cmpgt_epi32(v, vknee);
+    __m128 a = _mm_max_ps(_mm_cvtepi32_ps(_mm_sub_epi32(v, vknee)), zero);
+    __m128i m = _mm_add_epi32(vknee, _mm_cvttps_epi32(_mm_div_ps(_mm_mul_ps(range, a), _mm_add_ps(range, a))));
+
+    m = _mm_sub_epi32(_mm_xor_si128(m, sign), sign);
+    _mm_storeu_si128((__m128i*)(buf + i), _mm_or_si128(_mm_and_si128(over, m), _mm_andnot_si128(over, x)));
+  }
+
+  _softclip_s32_scalar(buf + i, len - i, knee, ceiling);
+}
+
+static int _hsum_epi32_sse2(__m128i x) {
+  x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)));
+  x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(x);
+}
+
+/*
+ * Lanes 0 - 3 and 4 - 7 each take a register. The state stays in registers
+ * for the whole call.
+ */
+static void _biquad_bank_sse2(int* accum, const float* in, unsigned int frames, struct pcm_biquad_bank* bank) {
+  __m128 b0[2], b1[2], b2[2], a1[2], a2[2];
+  __m128 z1[2][2], z2[2][2];
+  __m128 lo = _mm_set1_ps(-BIQUAD_LIMIT);
+  __m128 hi = _mm_set1_ps(BIQUAD_LIMIT);
+  unsigned int i, c, h;
+
+  for (h = 0; h < 2; h++) {
+    b0[h] = _mm_loadu_ps(bank->b0 + h * 4);
+    b1[h] = _mm_loadu_ps(bank->b1 + h * 4);
+    b2[h] = _mm_loadu_ps(bank->b2 + h * 4);
+    a1[h] = _mm_loadu_ps(bank->a1 + h * 4);
+    a2[h] = _mm_loadu_ps(bank->a2 + h * 4);
+    for (c = 0; c < 2; c++) {
+      z1[c][h] = _mm_loadu_ps(bank->z1[c] + h * 4);
+      z2[c][h] = _mm_loadu_ps(bank->z2[c] + h * 4);
+    }
+  }
+
+  for (i = 0; i < frames; i++) {
+    for (c = 0; c < 2; c++) {
+      const float* x = in + (i * 2 + c) * PCM_FILTER_LANES;
+      __m128i sum = _mm_setzero_si128();
+
+      for (h = 0; h < 2; h++) {
+        __m128 vx = _mm_loadu_ps(x + h * 4);
+        __m128 y = _mm_add_ps(_mm_mul_ps(b0[h], vx), z1[c][h]);
+
+        z1[c][h] = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1[h], vx), _mm_mul_ps(a1[h], y)), z2[c][h]);
+        z2[c][h] = _mm_sub_ps(_mm_mul_ps(b2[h], vx), _mm_mul_ps(a2[h], y));
+        sum = _mm_add_epi32(sum, _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(y, lo), hi)));
+      }
+
+      accum[i * 2 + c] += _hsum_epi32_sse2(sum);
+    }
+  }
+
+  for (h = 0; h < 2; h++) {
+    for (c = 0; c < 2; c++) {
+      _mm_storeu_ps(bank->z1[c] + h * 4, z1[c][h]);
+      _mm_storeu_ps(bank->z2[c] + h * 4, z2[c][h]);
+    }
+  }
+}
+
+static const struct pcm_kernels sse2_kernels = {
+  "sse2",
+  _widen_u8_sse2,
+  _gain_s16_sse2,
+  _mix_s16_sse2,
+  _add_s32_sse2,
+  _clip_s16_sse2,
+  _clip_f32_sse2,
+  _pan_gain_sse2,
+  _peak_s32_sse2,
+  _ramp_s32_sse2,
+  _softclip_s32_sse2,
+  _biquad_bank_sse2
+};
+
+/*
+ * AVX2 kernels. 256 bit packs work within each 128 bit lane so the results
+ * are put back in order with a cross lane permute.
+ */
+
+PCM_TARGET_AVX2
+static void _widen_u8_avx2(short* out, const unsigned char* in, unsigned int len) {
+  unsigned int i = 0;
+  __m128i bias = _mm_set1_epi8((char)0x80);
+
+  for (; i + 32 <= len; i += 32) {
+    __m256i lo = _mm256_cvtepi8_epi16(_mm_xor_si128(_mm_loadu_si128((const __m128i*)(in + i)), bias));
+    __m256i hi = _mm256_cvtepi8_epi16(_mm_xor_si128(_mm_loadu_si128((const __m128i*)(in + i + 16)), bias));
+
+    _mm256_storeu_si256((__m256i*)(out + i), _mm256_slli_epi16(lo, 8));
+    _mm256_storeu_si256((__m256i*)(out + i + 16), _mm256_slli_epi16(hi, 8));
+  }
+
+  _widen_u8_sse2(out + i, in + i, len - i);
+}
+
+PCM_TARGET_AVX2
+static void _gain_s16_avx2(short* buf, unsigned int len, unsigned int lvol, unsigned int rvol) {
+  unsigned int i = 0;
+  __m256i vol;
+
+  if (lvol >= 32768 && rvol >= 32768)
+    return;
+
+  if (lvol > 32767)
+    lvol = 32767;
+  if (rvol > 32767)
+    rvol = 32767;
+
+  vol = _mm256_set1_epi32((int)((rvol << 16) | lvol));
+
+  for (; i + 16 <= len; i += 16) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(buf + i));
+    __m256i plo = _mm256_mullo_epi16(x, vol);
+    __m256i phi = _mm256_mulhi_epi16(x, vol);
+    __m256i lo = _mm256_srai_epi32(_mm256_unpacklo_epi16(plo, phi), 15);
+    __m256i hi = _mm256_srai_epi32(_mm256_unpackhi_epi16(plo, phi), 15);
+
+    // unpack and pack are both per lane so the order is already restored.
+    _mm256_storeu_si256((__m256i*)(buf + i), _mm256_packs_epi32(lo, hi));
+  }
+
+  _gain_s16_sse2(buf + i, len - i, lvol, rvol);
+}
+
+PCM_TARGET_AVX2
+static void _mix_s16_avx2(int* accum, const short* in, unsigned int len) {
+  unsigned int i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    __m256i lo = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(in + i)));
+    __m256i hi = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(in + i + 8)));
+    __m256i a0 = _mm256_loadu_si256((const __m256i*)(accum + i));
+    __m256i a1 = _mm256_loadu_si256((const __m256i*)(accum + i + 8));
+
+    _mm256_storeu_si256((__m256i*)(accum + i), _mm256_add_epi32(a0, lo));
+    _mm256_storeu_si256((__m256i*)(accum + i + 8), _mm256_add_epi32(a1, hi));
+  }
+
+  _mix_s16_sse2(accum + i, in + i, len - i);
+}
+
+PCM_TARGET_AVX2
+static void _add_s32_avx2(int* accum, const int* in, unsigned int len) {
+  unsigned int i = 0;
+
+  for (; i + 8 <= len; i += 8) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(accum + i));
+    __m256i x = _mm256_loadu_si256((const __m256i*)(in + i));
+
+    _mm256_storeu_si256((__m256i*)(accum + i), _mm256_add_epi32(a, x));
+  }
+
+  _add_s32_sse2(accum + i, in + i, len - i);
+}
+
+PCM_TARGET_AVX2
+static void _clip_s16_avx2(short* out, const int* accum, unsigned int len) {
+  unsigned int i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    __m256i a0 = _mm256_loadu_si256((const __m256i*)(accum + i));
+    __m256i a1 = _mm256_loadu_si256((const __m256i*)(accum + i + 8));
+
+    _mm256_storeu_si256((__m256i*)(out + i), _mm256_permute4x64_epi64(_mm256_packs_epi32(a0, a1), 0xd8));
+  }
+
+  _clip_s16_sse2(out + i, accum + i, len - i);
+}
+
+PCM_TARGET_AVX2
+static void _clip_f32_avx2(float* out, const int* accum, unsigned int len) {
+  unsigned int i = 0;
+  __m256i lo = _mm256_set1_epi32(-32768);
+  __m256i hi = _mm256_set1_epi32(32767);
+  __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+
+  for (; i + 8 <= len; i += 8) {
+    __m256i a = _mm256_min_epi32(_mm256_max_epi32(_mm256_loadu_si256((const __m256i*)(accum + i)), lo), hi);
+
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(a), scale));
+  }
+
+  _clip_f32_sse2(out + i, accum + i, len - i);
+}
+
+PCM_TARGET_AVX2
+static void _pan_gain_avx2(unsigned int* lgain, unsigned int* rgain, const float* x, const float* y, unsigned int len, float near_dist, float far_dist) {
+  unsigned int i = 0;
+  __m256 scale = _mm256_set1_ps(1.0f / (far_dist - near_dist));
+  __m256 far = _mm256_set1_ps(far_dist);
+  __m256 zero = _mm256_setzero_ps();
+  __m256 one = _mm256_set1_ps(1.0f);
+  __m256 minus_one = _mm256_set1_ps(-1.0f);
+  __m256 tiny = _mm256_set1_ps(FLT_MIN);
+  __m256 full = _mm256_set1_ps(65536.0f);
+  __m256 half = _mm256_set1_ps(0.5f);
+
+  for (; i + 8 <= len; i += 8) {
+    __m256 vx = _mm256_loadu_ps(x + i);
+    __m256 vy = _mm256_loadu_ps(y + i);
+    __m256 d = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(vx, vx), _mm256_mul_ps(vy, vy)));
+    __m256 att = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(far, d), scale), zero), one);
+    __m256 pan = _mm256_min_ps(_mm256_max_ps(_mm256_div_ps(vx, _mm256_max_ps(d, tiny)), minus_one), one);
+    __m256 l = _mm256_mul_ps(att, _mm256_min_ps(_mm256_sub_ps(one, pan), one));
+    __m256 r = _mm256_mul_ps(att, _mm256_min_ps(_mm256_add_ps(one, pan), one));
+
+    _mm256_storeu_si256((__m256i*)(lgain + i), _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(l, full), half)));
+    _mm256_storeu_si256((__m256i*)(rgain + i), _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(r, full), half)));
+  }
+
+  _pan_gain_sse2(lgain + i, rgain + i, x + i, y + i, len - i, near_dist, far_dist);
+}
+
+PCM_TARGET_AVX2
+static int _peak_s32_avx2(const int* buf, unsigned int len) {
+  unsigned int i = 0;
+  __m256i peak = _mm256_setzero_si256();
+  int lanes[8];
+  int tail;
+  unsigned int k;
+
+  for (; i + 8 <= len; i += 8)
+    peak = _mm256_max_epi32(peak, _mm256_abs_epi32(_mm256_loadu_si256((const __m256i*)(buf + i))));
+
+  _mm256_storeu_si256((__m256i*)lanes, peak);
+  tail = _peak_s32_sse2(buf + i, len - i);
+  for (k = 0; k < 8; k++)
+    tail = tail > lanes[k] ? tail : lanes[k];
+
+  return tail;
+}
+
+PCM_TARGET_AVX2
+static void _ramp_s32_avx2(int* buf, unsigned int len, float gain, float step) {
+  unsigned int i = 0;
+  __m256 vgain = _mm256_set1_ps(gain);
+  __m256 vstep = _mm256_set1_ps(step);
+  __m256 frame = _mm256_set_ps(3.0f, 3.0f, 2.0f, 2.0f, 1.0f, 1.0f, 0.0f, 0.0f);
+  __m256 four = _mm256_set1_ps(4.0f);
+
+  if (gain == 1.0f && step == 0.0f)
+    return;
+
+  for (; i + 8 <= len; i += 8) {
+    __m256 x = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)(buf + i)));
+    __m256 g = _mm256_add_ps(vgain, _mm256_mul_ps(vstep, frame));
+
+    _mm256_storeu_si256((__m256i*)(buf + i), _mm256_cvttps_epi32(_mm256_mul_ps(x, g)));
+    frame = _mm256_add_ps(frame, four);
+  }
+
+  _ramp_s32_sse2_at(buf + i, len - i, gain, step, i >> 1);
+}
+
+PCM_TARGET_AVX2
+static void _softclip_s32_avx2(int* buf, unsigned int len, int knee, int ceiling) {
+  unsigned int i = 0;
+  __m256i vknee = _mm256_set1_epi32(knee);
+  __m256 zero = _mm256_setzero_ps();
+  __m256 range = _mm256_set1_ps((float)(ceiling - knee));
+
+  for (; i + 8 <= len; i += 8) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(buf + i));
+    __m256i v = _mm256_abs_epi32(x);
+    __m256i over = _mm256_cmpgt_epi32(v, vknee);
+    __m256 a = _mm256_max_ps(_mm256_cvtepi32_ps(_mm256_sub_epi32(v, vknee)), zero);
+    __m256i m = _mm256_add_epi32(vknee, _mm256_cvttps_epi32(_mm256_div_ps(_mm256_mul_ps(range, a), _mm256_add_ps(range, a))));
+
+    // sign_epi32 negates m where x is negative.
+    _mm256_storeu_si256((__m256i*)(buf + i), _mm256_blendv_epi8(x, _mm256_sign_epi32(m, x), over));
+  }
+
+  _softclip_s32_sse2(buf + i, len - i, knee, ceiling);
+}
+
+PCM_TARGET_AVX2
+static void _biquad_bank_avx2(int* accum, const float* in, unsigned int frames, struct pcm_biquad_bank* bank) {
+  __m256 b0 = _mm256_loadu_ps(bank->b0);
+  __m256 b1 = _mm256_loadu_ps(bank->b1);
+  __m256 b2 = _mm256_loadu_ps(bank->b2);
+  __m256 a1 = _mm256_loadu_ps(bank->a1);
+  __m256 a2 = _mm256_loadu_ps(bank->a2);
+  __m256 lo = _mm256_set1_ps(-BIQUAD_LIMIT);
+  __m256 hi = _mm256_set1_ps(BIQUAD_LIMIT);
+  __m256 z1[2], z2[2];
+  unsigned int i, c;
+
+  for (c = 0; c < 2; c++) {
+    z1[c] = _mm256_loadu_ps(bank->z1[c]);
+    z2[c] = _mm256_loadu_ps(bank->z2[c]);
+  }
+
+  for (i = 0; i < frames; i++) {
+    for (c = 0; c < 2; c++) {
+      __m256 x = _mm256_loadu_ps(in + (i * 2 + c) * PCM_FILTER_LANES);
+      __m256 y = _mm256_add_ps(_mm256_mul_ps(b0, x), z1[c]);
+      __m256i out;
+
+      z1[c] = _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(b1, x), _mm256_mul_ps(a1, y)), z2[c]);
+      z2[c] = _mm256_sub_ps(_mm256_mul_ps(b2, x), _mm256_mul_ps(a2, y));
+      out = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(y, lo), hi));
+
+      accum[i * 2 + c] += _hsum_epi32_sse2(_mm_add_epi32(_mm256_castsi256_si128(out), _mm256_extracti128_si256(out, 1)));
+    }
+  }
+
+  for (c = 0; c < 2; c++) {
+    _mm256_storeu_ps(bank->z1[c], z1[c]);
+    _mm256_storeu_ps(bank->z2[c], z2[c]);
+  }
+}
+
+static const struct pcm_kernels avx2_kernels = {
+  "avx2",
+  _widen_u8_avx2,
+  _gain_s16_avx2,
+  _mix_s16_avx2,
+  _add_s32_avx2,
+  _clip_s16_avx2,
+  _clip_f32_avx2,
+  _pan_gain_avx2,
+  _peak_s32_avx2,
+  _ramp_s32_avx2,
+  _softclip_s32_avx2,
+  _biquad_bank_avx2
+};
+
+static void _pcm_cpuid(unsigned int leaf, unsigned int sub, unsigned int regs[4]) {
+#ifdef _MSC_VER
+  __cpuidex((int*)regs, (int)leaf, (int)sub);
+#else
+  __cpuid_count(leaf, sub, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static unsigned long long _pcm_xgetbv() {
+#ifdef _MSC_VER
+  return _xgetbv(0);
+#else
+  unsigned int lo, hi;
+  __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+  return ((unsigned long long)hi << 32) | lo;
+#endif
+}
+
+static unsigned int _pcm_simd_level() {
+  unsigned int regs[4];
+  unsigned int max_leaf;
+
+  _pcm_cpuid(0, 0, regs);
+  max_leaf = regs[0];
+  if (max_leaf < 1)
+    return PCM_SIMD_SCALAR;
+
+  _pcm_cpuid(1, 0, regs);
+  if (!(regs[3] & (1 << 26)))
+    return PCM_SIMD_SCALAR;
+
+  // AVX2 also needs the OS to save the upper halves of the ymm registers.
+  if (max_leaf >= 7 && (regs[2] & (1 << 27))) {
+    if ((_pcm_xgetbv() & 6) == 6) {
+      _pcm_cpuid(7, 0, regs);
+      if (regs[1] & (1 << 5))
+        return PCM_SIMD_AVX2;
+    }
+  }
+
+  return PCM_SIMD_SSE2;
+}
+
+#else
+
+static unsigned int _pcm_simd_level() {
+  return PCM_SIMD_SCALAR;
+}
+
+#endif
+
+const struct pcm_kernels* pcm_simd_get(unsigned int level) {
+  if (level > _pcm_simd_level())
+    return NULL;
+
+  switch (level) {
+#ifdef PCM_SIMD_X86
+  case PCM_SIMD_AVX2:
+    return &avx2_kernels;
+  case PCM_SIMD_SSE2:
+    return &sse2_kernels;
+#endif
+  case PCM_SIMD_SCALAR:
+    return &scalar_kernels;
+  default:
+    return NULL;
+  }
+}
+
+const struct pcm_kernels* pcm_simd_select() {
+  return pcm_simd_get(_pcm_simd_level());
+}
+
+#ifdef PCM_SIMD_BENCHMARK
+
+#include <windows.h>
+
+#define BENCH_SAMPLES	(1024 * 2)
+#define BENCH_PASSES	20000
+
+static double bench_seconds(LARGE_INTEGER start, LARGE_INTEGER end) {
+  LARGE_INTEGER freq;
+  QueryPerformanceFrequency(&freq);
+  return (double)(end.QuadPart - start.QuadPart) / (double)freq.QuadPart;
+}
+
+static void bench_report(const char* kernel, const char* name, double secs) {
+  printf("%-8s %-10s %10.1f Msamples/sec\n", kernel, name, (double)BENCH_SAMPLES * BENCH_PASSES / secs / 1e6);
+}
+
+int main(int argc, char* argv[]) {
+  static unsigned char u8[BENCH_SAMPLES];
+  static short s16[BENCH_SAMPLES];
+  static int accum[BENCH_SAMPLES];
+  static int partial[BENCH_SAMPLES];
+  static float fx[BENCH_SAMPLES];
+  static float fy[BENCH_SAMPLES];
+  static unsigned int lgain[BENCH_SAMPLES];
+  static unsigned int rgain[BENCH_SAMPLES];
+  static float lanes[BENCH_SAMPLES * PCM_FILTER_LANES];
+  struct pcm_biquad_bank bank;
+  LARGE_INTEGER start, end;
+  unsigned int level, i, pass;
+
+  for (level = PCM_SIMD_SCALAR; level <= PCM_SIMD_AVX2; level++) {
+    const struct pcm_kernels* k = pcm_simd_get(level);
+    if (k == NULL)
+      continue;
+
+    for (i = 0; i < BENCH_SAMPLES; i++) {
+      u8[i] = (unsigned char)rand();
+      s16[i] = (short)rand();
+      accum[i] = 0;
+      partial[i] = rand() % 16 - 8;
+      fx[i] = (float)(rand() % 2000 - 1000);
+      fy[i] = (float)(rand() % 2000 - 1000);
+    }
+
+    QueryPerformanceCounter(&start);
+    for (pass = 0; pass < BENCH_PASSES; pass++)
+      k->widen_u8(s16, u8, BENCH_SAMPLES);
+    QueryPerformanceCounter(&end);
+    bench_report(k->name, "widen_u8", bench_seconds(start, end));
+
+    QueryPerformanceCounter(&start);
+    for (pass = 0; pass < BENCH_PASSES; pass++)
+      k->gain_s16(s16, BENCH_SAMPLES, 32767, 32766);
+    QueryPerformanceCounter(&end);
+    bench_report(k->name, "gain_s16", bench_seconds(start, end));
+
+    QueryPerformanceCounter(&start);
+    for (pass = 0; pass < BENCH_PASSES; pass++)
+      k->mix_s16(accum, s16, BENCH_SAMPLES);
+    QueryPerformanceCounter(&end);
+    bench_report(k->name, "mix_s16", bench_seconds(start, end));
+
+    QueryPerformanceCounter(&start);
+    for (pass = 0; pass < BENCH_PASSES; pass++)
+      k->add_s32(accum, partial, BENCH_SAMPLES);
+    QueryPerformanceCounter(&end);
+    bench_report(k->name, "add_s32", bench_seconds(start, end));
+
+    QueryPerformanceCounter(&start);
+    for (pass = 0; pass < BENCH_PASSES; pass++)
+      k->clip_s16(s16, accum, BENCH_SAMPLES);
+    QueryPerformanceCounter(&end);
+    bench_report(k->name, "clip_s16", bench_seconds(start, end));
+
+    QueryPerformanceCounter(&start);
+    for (pass = 0; pass < BENCH_PASSES; pass++)
+      k->clip_f32(fx, accum, BENCH_SAMPLES);
+    QueryPerformanceCounter(&end);
+    bench_report(k->name, "clip_f32", bench_seconds(start, end));
+
+    QueryPerformanceCounter(&start);
+    for (pass = 0; pass < BENCH_PASSES; pass++)
+      k->pan_gain(lgain, rgain, fx, fy, BENCH_SAMPLES, 160.0f, 1200.0f);
+    QueryPerformanceCounter(&end);
+    bench_report(k->name, "pan_gain", bench_seconds(start, end));
+
+    for (i = 0; i < BENCH_SAMPLES; i++)
+      accum[i] = (rand() % 65536 - 32768) * 2;
+
+    QueryPerformanceCounter(&start);
+    for (pass = 0; pass < BENCH_PASSES; pass++)
+      k->peak_s32(accum, BENCH_SAMPLES);
+    QueryPerformanceCounter(&end);
+    bench_report(k->name, "peak_s32", bench_seconds(start, end));
+
+    QueryPerformanceCounter(&start);
+    for (pass = 0; pass < BENCH_PASSES; pass++)
+      k->ramp_s32(accum, BENCH_SAMPLES, 1.0f, -1.0f / BENCH_SAMPLES);
+    QueryPerformanceCounter(&end);
+    bench_report(k->name, "ramp_s32", bench_seconds(start, end));
+
+    for (i = 0; i < BENCH_SAMPLES; i++)
+      accum[i] = (rand() % 65536 - 32768) * 2;
+
+    QueryPerformanceCounter(&start);
+    for (pass = 0; pass < BENCH_PASSES; pass++)
+      k->softclip_s32(accum, BENCH_SAMPLES, 26214, 32767);
+    QueryPerformanceCounter(&end);
+    bench_report(k->name, "softclip", bench_seconds(start, end));
+
+    // A bank of low-pass filters over a block of 1024 frames.
+    for (i = 0; i < PCM_FILTER_LANES; i++) {
+      bank.b0[i] = 0.0200834f;
+      bank.b1[i] = 0.0401667f;
+      bank.b2[i] = 0.0200834f;
+      bank.a1[i] = -1.5610181f;
+      bank.a2[i] = 0.6413515f;
+      bank.z1[0][i] = bank.z1[1][i] = 0.0f;
+      bank.z2[0][i] = bank.z2[1][i] = 0.0f;
+    }
+    for (i = 0; i < BENCH_SAMPLES * PCM_FILTER_LANES; i++)
+      lanes[i] = (float)(rand() % 65536 - 32768);
+    memset(accum, 0, sizeof(accum));
+
+    QueryPerformanceCounter(&start);
+    for (pass = 0; pass < BENCH_PASSES; pass++)
+      k->biquad_bank(accum, lanes, BENCH_SAMPLES / 2, &bank);
+    QueryPerformanceCounter(&end);
+    bench_report(k->name, "biquad x8", bench_seconds(start, end));
+  }
+
+  return EXIT_SUCCESS;
+}
+
+#endif
@@ -0,0 +1,136 @@
+/*
+ * DjMM
+ * v0.1
+ *
+ * Copyright (c) 2011, David J. Rager
+ * djrager@fourthwoods.com
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * pcm_simd.h
+ *
+ *  Created on: Oct 16, 2026
+ *      Author: David J. Rager
+ *       Email: djrager@fourthwoods.com
+ */
+
+#ifndef PCM_SIMD_H_
+#define PCM_SIMD_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PCM_SIMD_SCALAR	0
+#define PCM_SIMD_SSE2	1
+#define PCM_SIMD_AVX2	2
+
+// Voices filtered together by one biquad_bank call.
+#define PCM_FILTER_LANES	8
+
+/*
+ * Biquads for PCM_FILTER_LANES voices, one per lane, laid out structure of
+ * arrays so a SIMD register holds the same coefficient or state for several
+ * voices. Transposed direct form II, with separate state for the left and
+ * right channel. Lanes with all zero coefficients output silence.
+ */
+struct pcm_biquad_bank {
+  float b0[PCM_FILTER_LANES];
+  float b1[PCM_FILTER_LANES];
+  float b2[PCM_FILTER_LANES];
+  float a1[PCM_FILTER_LANES];
+  float a2[PCM_FILTER_LANES];
+  float z1[2][PCM_FILTER_LANES];
+  float z2[2][PCM_FILTER_LANES];
+};
+
+/*
+ * Inner loops of the PCM mixer. Every implementation produces bit identical
+ * results so the mixer output does not depend on the CPU it runs on.
+ *
+ * Buffers are interleaved stereo (or mono, with lvol == rvol) and len is the
+ * number of samples, not frames. Buffers need not be aligned.
+ */
+struct pcm_kernels {
+  const char* name;
+
+  // Converts u8 samples, biased by 128, to s16.
+  void (*widen_u8)(short* out, const unsigned char* in, unsigned int len);
+
+  // s16 samples. Volume is 0 - 32768, full volume on both channels leaves
+  // the buffer untouched.
+  void (*gain_s16)(short* buf, unsigned int len, unsigned int lvol, unsigned int rvol);
+
+  // Adds s16 samples into the 32 bit mix accumulator.
+  void (*mix_s16)(int* accum, const short* in, unsigned int len);
+
+  // Adds another 32 bit accumulator into the mix accumulator.
+  void (*add_s32)(int* accum, const int* in, unsigned int len);
+
+  // Saturates the 32 bit mix accumulator to s16 output.
+  void (*clip_s16)(short* out, const int* accum, unsigned int len);
+
+  // Saturates the 32 bit mix accumulator to the s16 range and scales it to
+  // float output in [-1, 1).
+  void (*clip_f32)(float* out, const int* accum, unsigned int len);
+
+  // Stereo gains, 16.16 fixed point 0 - 65536, for len sources at x (to the
+  // right) and y (ahead) of the listener. Full gain up to near_dist, falling
+  // off linearly to silence at far_dist, then panned by the share of the
+  // distance that lies to either side. far_dist must be more than
+  // near_dist.
+  void (*pan_gain)(unsigned int* lgain, unsigned int* rgain, const float* x, const float* y, unsigned int len, float near_dist, float far_dist);
+
+  // Largest magnitude in the 32 bit mix accumulator. Samples must lie within
+  // +/- 2^30.
+  int (*peak_s32)(const int* buf, unsigned int len);
+
+  // Scales stereo accumulator frames by a gain ramp, gain + step * i for
+  // frame i, truncating towards zero. Samples must lie within +/- 2^24.
+  void (*ramp_s32)(int* buf, unsigned int len, float gain, float step);
+
+  // Leaves samples up to knee alone and bends larger ones smoothly towards
+  // ceiling, which they never reach. knee must be less than ceiling.
+  void (*softclip_s32)(int* buf, unsigned int len, int knee, int ceiling);
+
+  // Runs each lane of in, frames stereo frames of PCM_FILTER_LANES samples
+  // per channel (frame, then channel, then lane), through its lane's biquad
+  // and adds the lanes' outputs, truncated towards zero and held within
+  // +/- 2^20, into the stereo accumulator. The bank's state is updated.
+  void (*biquad_bank)(int* accum, const float* in, unsigned int frames, struct pcm_biquad_bank* bank);
+};
+
+/*
+ * Returns the fastest set of kernels the CPU supports.
+ */
+const struct pcm_kernels* pcm_simd_select();
+
+/*
+ * Returns the kernels for a specific level (PCM_SIMD_SCALAR, PCM_SIMD_SSE2 or
+ * PCM_SIMD_AVX2), or NULL if the level is not supported by the CPU or the
+ * build.
+ */
+const struct pcm_kernels* pcm_simd_get(unsigned int level);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PCM_SIMD_H_ */
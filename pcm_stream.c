@@ -0,0 +1,412 @@
+/*
+ * DjMM
+ * v0.1
+ *
+ * Copyright (c) 2011, David J. Rager
+ * djrager@fourthwoods.com
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * pcm_stream.c
+ *
+ *  Created on: Oct 16, 2026
+ *      Author: David J. Rager
+ *       Email: djrager@fourthwoods.com
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "pcm_stream.h"
+
+#define STREAM_MASK	(PCM_STREAM_FRAMES - 1)
+
+/*
+ * One thread reads for every open stream. The mutex guards the list of
+ * streams and is never held across a read, so a thread opening or closing
+ * one stream does not wait for the file of another.
+ */
+static struct {
+  HANDLE mutex;
+  HANDLE wake; // auto-reset, a stream is running low
+  HANDLE thread;
+  volatile LONG quit;
+  struct pcm_stream* streams;
+} io;
+
+static DWORD WINAPI _stream_proc(LPVOID param);
+static struct pcm_stream* _stream_next();
+static void _stream_fill(struct pcm_stream* st, unsigned int limit);
+static int _stream_header(struct pcm_stream* st);
+
+static unsigned int get_le16(const unsigned char* p) {
+  return p[0] | (p[1] << 8);
+}
+
+static unsigned int get_le32(const unsigned char* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+int pcm_stream_init() {
+  io.streams = NULL;
+  io.quit = 0;
+
+  io.mutex = CreateMutex(NULL, FALSE, NULL);
+  if (io.mutex == NULL)
+    goto error1;
+
+  io.wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+  if (io.wake == NULL)
+    goto error2;
+
+  io.thread = CreateThread(NULL, 0, _stream_proc, NULL, 0, NULL);
+  if (io.thread == NULL)
+    goto error3;
+
+  return 1;
+
+error3:
+  CloseHandle(io.wake);
+
+error2:
+  CloseHandle(io.mutex);
+
+error1:
+  io.mutex = io.wake = io.thread = NULL;
+  return 0;
+}
+
+void pcm_stream_shutdown() {
+  if (io.thread == NULL)
+    return;
+
+  InterlockedExchange(&io.quit, 1);
+  SetEvent(io.wake);
+  WaitForSingleObject(io.thread, INFINITE);
+
+  CloseHandle(io.thread);
+  CloseHandle(io.wake);
+  CloseHandle(io.mutex);
+  io.mutex = io.wake = io.thread = NULL;
+}
+
+struct pcm_stream* pcm_stream_open(const char* filename) {
+  struct pcm_stream* st = (struct pcm_stream*)calloc(1, sizeof(struct pcm_stream));
+  if (st == NULL)
+    goto error1;
+
+  st->file = fopen(filename, "rb");
+  if (st->file == NULL)
+    goto error2;
+
+  if (!_stream_header(st))
+    goto error3;
+
+  st->ring = (short*)malloc(PCM_STREAM_FRAMES * st->channels * sizeof(short));
+  if (st->ring == NULL)
+    goto error3;
+
+  st->chunk = (unsigned char*)malloc(PCM_STREAM_CHUNK * st->channels * st->bits / 8);
+  if (st->chunk == NULL)
+    goto error4;
+
+  st->lock = CreateMutex(NULL, FALSE, NULL);
+  if (st->lock == NULL)
+    goto error5;
+
+  pcm_stream_rewind(st);
+
+  WaitForSingleObject(io.mutex, INFINITE);
+  st->next = io.streams;
+  io.streams = st;
+  ReleaseMutex(io.mutex);
+
+  SetEvent(io.wake);
+  return st;
+
+error5:
+  free(st->chunk);
+
+error4:
+  free(st->ring);
+
+error3:
+  fclose(st->file);
+
+error2:
+  free(st);
+
+error1:
+  return NULL;
+}
+
+void pcm_stream_close(struct pcm_stream* st) {
+  struct pcm_stream** link;
+
+  WaitForSingleObject(io.mutex, INFINITE);
+  for (link = &io.streams; *link != NULL; link = &(*link)->next) {
+    if (*link == st) {
+      *link = st->next;
+      break;
+    }
+  }
+  ReleaseMutex(io.mutex);
+
+  // Off the list the I/O thread can not pick the stream again, but it may
+  // still be reading it.
+  WaitForSingleObject(st->lock, INFINITE);
+  ReleaseMutex(st->lock);
+  CloseHandle(st->lock);
+
+  fclose(st->file);
+  free(st->chunk);
+  free(st->ring);
+  free(st);
+}
+
+void pcm_stream_rewind(struct pcm_stream* st) {
+  InterlockedIncrement(&st->rewinds);
+  InterlockedExchange(&st->wanted, 1);
+
+  SetEvent(io.wake);
+}
+
+int pcm_stream_ready(struct pcm_stream* st) {
+  return st->ready == st->rewinds;
+}
+
+void pcm_stream_consume(struct pcm_stream* st, LONG first) {
+  LONG ahead = (LONG)((unsigned long)st->head - (unsigned long)first);
+
+  InterlockedExchange(&st->read, first);
+
+  // Wake the I/O thread once the ring is half used up.
+  if (ahead < PCM_STREAM_FRAMES / 2 && InterlockedExchange(&st->wanted, 1) == 0)
+    SetEvent(io.wake);
+}
+
+void pcm_stream_fetch(struct pcm_stream* st, short* dst, LONG first, unsigned int count) {
+  LONG head = st->head;
+  LONG avail = (LONG)((unsigned long)head - (unsigned long)first);
+  unsigned int have = avail <= 0 ? 0 : ((unsigned long)avail < count ? (unsigned int)avail : count);
+  unsigned int at = (unsigned long)first & STREAM_MASK;
+  unsigned int n;
+
+  // Read the ring only after head, the frames below it are complete.
+  MemoryBarrier();
+
+  n = PCM_STREAM_FRAMES - at < have ? PCM_STREAM_FRAMES - at : have;
+  memcpy(dst, st->ring + at * st->channels, n * st->channels * sizeof(short));
+  memcpy(dst + n * st->channels, st->ring, (have - n) * st->channels * sizeof(short));
+
+  if (have < count) {
+    memset(dst + have * st->channels, 0, (count - have) * st->channels * sizeof(short));
+    st->underruns += count - have;
+  }
+}
+
+static DWORD WINAPI _stream_proc(LPVOID param) {
+  struct pcm_stream* st;
+
+  while (WaitForSingleObject(io.wake, INFINITE) == WAIT_OBJECT_0) {
+    if (io.quit) {
+      break;
+    }
+
+    while ((st = _stream_next()) != NULL) {
+      LONG rewinds = st->rewinds;
+
+      // A rewind that comes in after this leaves the stream not ready and
+      // wanted, so it is started over again on the next pass.
+      if (rewinds != st->started) {
+        st->started = rewinds;
+        st->head = 0;
+        st->read = 0;
+        st->file_pos = 0;
+
+        // Enough to start playing, then the rest.
+        _stream_fill(st, PCM_STREAM_PREFILL);
+        MemoryBarrier();
+        InterlockedExchange(&st->ready, rewinds);
+      }
+
+      _stream_fill(st, PCM_STREAM_FRAMES);
+      ReleaseMutex(st->lock);
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Finds a stream that wants reading and returns it with its lock held, or
+ * NULL if none does. The list is searched from the start each time since a
+ * stream may be closed as soon as its lock is released.
+ */
+static struct pcm_stream* _stream_next() {
+  struct pcm_stream* st;
+
+  WaitForSingleObject(io.mutex, INFINITE);
+  for (st = io.streams; st != NULL; st = st->next) {
+    if (InterlockedExchange(&st->wanted, 0)) {
+      WaitForSingleObject(st->lock, INFINITE);
+      break;
+    }
+  }
+  ReleaseMutex(io.mutex);
+
+  return st;
+}
+
+/*
+ * Reads until the ring holds limit frames past the mixer's read position or
+ * the file runs out. I/O thread only, with the stream's lock held.
+ */
+static void _stream_fill(struct pcm_stream* st, unsigned int limit) {
+  unsigned int frame_bytes = st->channels * st->bits / 8;
+
+  for (;;) {
+    LONG head = st->head;
+    LONG ahead = (LONG)((unsigned long)head - (unsigned long)st->read);
+    unsigned int n, got, i;
+    long offset;
+    short* out;
+
+    // The mixer moved past the ring without reading, a voice that was too
+    // quiet to mix only moves its position. Carry on from where it is.
+    if (ahead < 0) {
+      unsigned long long pos = (unsigned long long)st->file_pos + (unsigned long)-ahead;
+
+      if (st->looping && st->frames > 0)
+        st->file_pos = (unsigned int)(pos % st->frames);
+      else
+        st->file_pos = pos < st->frames ? (unsigned int)pos : st->frames;
+
+      head = st->read;
+      InterlockedExchange(&st->head, head);
+      ahead = 0;
+    }
+
+    if ((unsigned long)ahead >= limit)
+      break;
+
+    if (st->file_pos >= st->frames) {
+      if (!st->looping || st->frames == 0)
+        break;
+      st->file_pos = 0;
+    }
+
+    n = limit - ahead;
+    if (n > PCM_STREAM_CHUNK)
+      n = PCM_STREAM_CHUNK;
+    if (n > st->frames - st->file_pos)
+      n = st->frames - st->file_pos;
+    if (n > PCM_STREAM_FRAMES - ((unsigned long)head & STREAM_MASK))
+      n = PCM_STREAM_FRAMES - ((unsigned long)head & STREAM_MASK);
+
+    offset = st->data + (long)st->file_pos * frame_bytes;
+    if (offset != st->file_at)
+      fseek(st->file, offset, SEEK_SET);
+
+    got = (unsigned int)fread(st->chunk, frame_bytes, n, st->file);
+    st->file_at = offset + (long)got * frame_bytes;
+
+    // A file shorter than its header says plays out as silence.
+    if (got < n) {
+      memset(st->chunk + got * frame_bytes, st->bits == 8 ? 128 : 0, (n - got) * frame_bytes);
+      st->file_at = -1;
+    }
+
+    out = st->ring + ((unsigned long)head & STREAM_MASK) * st->channels;
+    if (st->bits == 8) {
+      for (i = 0; i < n * st->channels; i++)
+        out[i] = (short)(((int)st->chunk[i] - 128) * 256);
+    } else {
+      memcpy(out, st->chunk, n * frame_bytes);
+    }
+
+    // The frames must be in the ring before the mixer can see them.
+    MemoryBarrier();
+    InterlockedExchange(&st->head, (LONG)((unsigned long)head + n));
+    st->file_pos += n;
+  }
+}
+
+/*
+ * Reads the format of the file and finds its first frame.
+ */
+static int _stream_header(struct pcm_stream* st) {
+  unsigned char hdr[24];
+  unsigned int size, format = 0;
+  long at;
+
+  if (fread(hdr, 1, 12, st->file) != 12)
+    return 0;
+
+  if (memcmp(hdr, "RIFF", 4) != 0 || memcmp(hdr + 8, "WAVE", 4) != 0) {
+    // A DMX lump, 8 bit mono with 16 bytes of padding on either side.
+    if (get_le16(hdr) != 3 || fread(hdr + 12, 1, 12, st->file) != 12)
+      return 0;
+
+    size = get_le32(hdr + 4);
+    if (size < 32)
+      return 0;
+
+    st->rate = get_le16(hdr + 2);
+    st->bits = 8;
+    st->channels = 1;
+    st->frames = size - 32;
+    st->data = 24;
+  } else {
+    at = 12;
+    for (;;) {
+      if (fseek(st->file, at, SEEK_SET) != 0 || fread(hdr, 1, 8, st->file) != 8)
+        return 0;
+
+      size = get_le32(hdr + 4);
+
+      if (memcmp(hdr, "fmt ", 4) == 0) {
+        if (size < 16 || fread(hdr + 8, 1, 16, st->file) != 16)
+          return 0;
+
+        format = get_le16(hdr + 8);
+        st->channels = get_le16(hdr + 10);
+        st->rate = get_le32(hdr + 12);
+        st->bits = get_le16(hdr + 22);
+      } else if (memcmp(hdr, "data", 4) == 0) {
+        break;
+      }
+
+      // Chunks are padded to an even length.
+      at += 8 + size + (size & 1);
+    }
+
+    if (format != 1 || (st->bits != 8 && st->bits != 16) || st->channels < 1 || st->channels > 2)
+      return 0;
+
+    st->data = at + 8;
+    st->frames = size / (st->channels * st->bits / 8);
+  }
+
+  if (st->rate == 0)
+    return 0;
+
+  st->file_at = -1;
+  return 1;
+}
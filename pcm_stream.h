@@ -0,0 +1,133 @@
+/*
+ * DjMM
+ * v0.1
+ *
+ * Copyright (c) 2011, David J. Rager
+ * djrager@fourthwoods.com
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * pcm_stream.h
+ *
+ *  Created on: Oct 16, 2026
+ *      Author: David J. Rager
+ *       Email: djrager@fourthwoods.com
+ */
+
+#ifndef PCM_STREAM_H_
+#define PCM_STREAM_H_
+
+#include <stdio.h>
+#include <windows.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PCM_STREAM_FRAMES	65536 // ring size, must be a power of 2
+#define PCM_STREAM_CHUNK	4096  // most frames read from the file at once
+#define PCM_STREAM_PREFILL	8192  // frames read before playback may start
+
+/*
+ * A sound played straight from its file. The file is read by a background
+ * thread into a ring of s16 frames ahead of the mixer, so a stream takes the
+ * same memory whatever the length of the file.
+ *
+ * Frames are numbered in the order they play, a looping stream carries on
+ * from the start of the file after the last frame, and the numbers are
+ * compared as differences so they may wrap. The I/O thread owns head and the
+ * mixer owns read. The ring holds frames from read up to head.
+ *
+ * Only the I/O thread reads the file, holding the stream's own lock while it
+ * does. A rewind just asks it to start over and the stream is not ready
+ * until the first PCM_STREAM_PREFILL frames are back in the ring.
+ */
+struct pcm_stream {
+  FILE* file;
+  long data;     // file offset of the first frame
+  long file_at;  // file offset the next read starts at
+  unsigned int rate;
+  unsigned int bits;
+  unsigned int channels;
+  unsigned int frames;
+
+  short* ring;
+  unsigned char* chunk; // one read's worth of file bytes
+
+  volatile LONG head;    // first frame not yet in the ring
+  volatile LONG read;    // first frame the mixer still needs
+  volatile LONG wanted;  // the mixer has woken the I/O thread
+  volatile LONG looping;
+  volatile LONG busy;    // a voice is playing the stream
+  volatile LONG rewinds; // counts calls to pcm_stream_rewind()
+  volatile LONG ready;   // value of rewinds the prefill in the ring is for
+  LONG started;          // value of rewinds the I/O thread last started over for
+  HANDLE lock;           // held by the I/O thread while it reads
+  unsigned int file_pos; // file frame of head
+  LONG underruns;        // frames mixed as silence because they were late
+
+  struct pcm_stream* next;
+};
+
+/*
+ * Starts and stops the I/O thread. Streams must all be closed before
+ * pcm_stream_shutdown().
+ */
+int pcm_stream_init();
+void pcm_stream_shutdown();
+
+/*
+ * Opens an 8 or 16 bit mono or stereo PCM WAV file, or a DMX sound lump, and
+ * has the I/O thread read the start of it. Returns NULL if the file can not
+ * be read or is in another format.
+ */
+struct pcm_stream* pcm_stream_open(const char* filename);
+void pcm_stream_close(struct pcm_stream* st);
+
+/*
+ * Goes back to the first frame of the file. The mixer must not be reading
+ * the stream, and must wait for pcm_stream_ready() before it does again.
+ * Never waits for the file.
+ */
+void pcm_stream_rewind(struct pcm_stream* st);
+
+/*
+ * Returns 1 once the frames after the last rewind up to PCM_STREAM_PREFILL
+ * are in the ring, 0 while the I/O thread is still reading them.
+ */
+int pcm_stream_ready(struct pcm_stream* st);
+
+/*
+ * Tells the I/O thread the mixer will not read anything before frame first
+ * again, waking it if the ring is running low.
+ */
+void pcm_stream_consume(struct pcm_stream* st, LONG first);
+
+/*
+ * Copies count frames starting at frame first into dst, for the mixer.
+ * Frames the I/O thread has not read yet are silence.
+ */
+void pcm_stream_fetch(struct pcm_stream* st, short* dst, LONG first, unsigned int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PCM_STREAM_H_ */